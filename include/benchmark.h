@@ -0,0 +1,25 @@
+/**
+ * @brief On target cycle benchmarks for the hot paths
+ * @note Only built in when ENABLE_BENCHMARKS is defined, e.g. bazel build --copt=-DENABLE_BENCHMARKS
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "rtt.h"
+#include "time.h"
+
+#define BENCHMARK_ITERATIONS_LOG2 8
+
+// Runs expr 2^BENCHMARK_ITERATIONS_LOG2 times and reports the average cycle count over RTT
+#define BENCHMARK(name, expr) {                                                    \
+  uint32_t bench_start = system_cycles();                                          \
+  for(uint32_t bench_index = 0; bench_index < (1 << BENCHMARK_ITERATIONS_LOG2); bench_index++) { \
+    expr;                                                                          \
+  }                                                                                \
+  uint32_t bench_cycles = system_cycles() - bench_start;                           \
+  rtt_printf("BM %s: %d cyc", name, bench_cycles >> BENCHMARK_ITERATIONS_LOG2);    \
+}
+
+void run_benchmarks();
@@ -0,0 +1,84 @@
+/**
+ * @brief Ring of recent events kept in RAM across a reset for post-mortem debugging
+ * @note The record lives in .noinit so a fault can reset the part and the next boot still sees what led up to it
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define BLACK_BOX_EVENTS 32
+#define BLACK_BOX_MAGIC 0xB1ACB0C5
+
+// Words the core stacks on exception entry, r0-r3, r12, lr, pc, xpsr
+#define BLACK_BOX_FRAME_WORDS 8
+#define BLACK_BOX_FRAME_LR 5
+#define BLACK_BOX_FRAME_PC 6
+#define BLACK_BOX_FRAME_XPSR 7
+
+
+enum class BlackBoxEvent : uint8_t {
+  boot = 0,      // Data is the upper half of RCC_CSR, the reset flags
+  pd_rx,         // Data is the message header
+  pd_tx,         // Data is the message header
+  pd_hard_reset, // Data is 1 when sent, 0 when received
+  load_mode,     // Data is the LoadMode
+  output_on,     // Data is the supply voltage in 50mV
+  output_off,
+  port_reset,    // Source is the port that was reset
+  fault          // Data is the exception number
+};
+
+
+struct BlackBoxEntry {
+  uint32_t time;
+  BlackBoxEvent event;
+  uint8_t source;
+  uint16_t data;
+};
+
+struct BlackBoxRecord {
+  uint32_t magic;
+  uint32_t head;
+  uint32_t count;
+  BlackBoxEntry entries[BLACK_BOX_EVENTS];
+
+  // Filled in by the fault handler
+  uint32_t fault_exception;
+  uint32_t fault_frame[BLACK_BOX_FRAME_WORDS];
+};
+
+
+// Hands the stacked exception frame to a C handler, picking MSP or PSP from EXC_RETURN
+// Has to be the whole body of a naked handler so lr still holds EXC_RETURN
+#define BLACK_BOX_FAULT_ENTRY(handler)  \
+  asm volatile(                         \
+    "movs r0, #4      \n"               \
+    "mov  r1, lr      \n"               \
+    "tst  r0, r1      \n"               \
+    "beq  1f          \n"               \
+    "mrs  r0, psp     \n"               \
+    "b    2f          \n"               \
+    "1:               \n"               \
+    "mrs  r0, msp     \n"               \
+    "2:               \n"               \
+    "ldr  r1, =" #handler "\n"          \
+    "bx   r1          \n"               \
+    ".ltorg           \n"               \
+  )
+
+
+namespace black_box {
+
+
+// Dump the previous run over RTT if it ended in a fault and start a new record, call once RTT is up
+void init();
+
+// Safe from the main loop and interrupts
+void record(BlackBoxEvent event, uint8_t source = 0, uint16_t data = 0);
+
+// Snapshot the stacked frame and active exception, then reset the part
+void fault(const uint32_t* frame) __attribute__((noreturn));
+
+
+} // namespace black_box
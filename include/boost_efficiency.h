@@ -0,0 +1,53 @@
+/**
+ * @brief Efficiency model for the 48V boost stage
+ * @note Efficiency is looked up from a table of input voltages and input powers and linearly interpolated
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "units.h"
+
+#define BOOST_EFFICIENCY_VOLTAGE_POINTS 5
+#define BOOST_EFFICIENCY_LOAD_POINTS 3
+
+// Supplies at this voltage feed the output directly with the boost off, only the diode and switches are lost
+#define BOOST_BYPASS_VOLTAGE_MV 48000
+#define BOOST_BYPASS_EFFICIENCY_PERMILLE 985
+
+
+// Efficiency in 1/1000ths, voltages and loads must be increasing
+struct BoostEfficiencyTable {
+  units::millivolts voltage[BOOST_EFFICIENCY_VOLTAGE_POINTS];
+  units::milliwatts load[BOOST_EFFICIENCY_LOAD_POINTS];
+  uint16_t permille[BOOST_EFFICIENCY_VOLTAGE_POINTS][BOOST_EFFICIENCY_LOAD_POINTS];
+};
+
+// Estimates for the stock boost stage, not measured on this board
+// Read off typical synchronous boost controller datasheet curves for a 48V output and derated a few percent
+// for the layout, boards with bench data should pass it to PowerMux::set_boost_efficiency
+extern const BoostEfficiencyTable default_boost_efficiency;
+
+
+class BoostEfficiency {
+public:
+  BoostEfficiency(const BoostEfficiencyTable& table = default_boost_efficiency) : _table(&table) {};
+
+  void set_table(const BoostEfficiencyTable& table) { _table = &table; };
+
+  // Efficiency in 1/1000ths for a given input voltage and power drawn from the supplies
+  uint32_t efficiency(units::millivolts input_voltage, units::milliwatts input_power) const;
+
+  // Power delivered to the 48V output for a given input
+  units::milliwatts output_power(units::millivolts input_voltage, units::milliwatts input_power) const;
+
+  // Power that has to be drawn from the supplies to deliver a given output
+  units::milliwatts input_power(units::millivolts input_voltage, units::milliwatts output_power) const;
+
+private:
+  const BoostEfficiencyTable* _table;
+
+  // Efficiency across the load points at one of the voltage points
+  uint32_t efficiency_at(uint8_t voltage_point, units::milliwatts input_power) const;
+};
@@ -0,0 +1,33 @@
+/**
+ * @brief Board calibration, measured on the first boot and kept in the config store
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "config_store.h"
+
+// Bumped whenever the layout or the way a value is measured changes so older boards measure again
+#define CALIBRATION_VERSION 2
+
+#define ADC_GAIN_ONE_Q12 4096
+
+
+struct Calibration {
+  uint16_t version = 0;
+
+  // Result of the ADC self calibration, written back on later boots instead of running it again
+  uint16_t adc_calfact = 0;
+
+  // Current sense reading with the load off, averaged
+  uint32_t current_no_load_counts = 0;
+
+  // Correction for VDDA being off nominal in Q12, every channel is read against the same reference
+  uint16_t adc_gain_q12 = ADC_GAIN_ONE_Q12;
+};
+
+
+// False if there isn't one or it's from an older version, the calibration is left as it was
+bool load_calibration(ConfigStore& store, Calibration& calibration);
+bool save_calibration(ConfigStore& store, const Calibration& calibration);
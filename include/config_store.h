@@ -0,0 +1,70 @@
+/**
+ * @brief Key value store for settings and statistics kept across power cycles
+ * @note Records are appended to a ring of flash pages. The page after the one being written is kept erased,
+ *       when the ring moves on the oldest page has its live records copied forward and becomes the new spare.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "flash.h"
+
+// Reserved at the end of bank 2 by the linker script
+#define CONFIG_STORE_PAGES 4
+#define CONFIG_STORE_MAGIC 0x31474643  // "CFG1"
+
+#define CONFIG_PAGE_HEADER_SIZE 8
+#define CONFIG_RECORD_HEADER_SIZE 8
+
+// Largest value for a key, the newest record of every key has to fit in one page
+#define CONFIG_MAX_VALUE_SIZE 256
+
+
+enum class ConfigKey : uint8_t {
+  contract_cache = 0,
+  calibration,
+  count
+};
+
+static_assert(CONFIG_PAGE_HEADER_SIZE + ((uint16_t)ConfigKey::count + 1) * (CONFIG_RECORD_HEADER_SIZE + CONFIG_MAX_VALUE_SIZE) <= FLASH_PAGE_SIZE,
+              "Live records don't fit in a config page");
+
+
+class ConfigStore {
+public:
+  // Index the newest record of each key in one pass, the pages are formatted the first time
+  void init();
+
+  // Copy out the newest value, false if there isn't one of the same version and size
+  // Owners bump the version when the layout of a value changes so an old one is never read back as the new
+  bool read(ConfigKey key, uint8_t version, void* data, uint16_t size);
+
+  // Append a new value, writing the same value again is skipped to save wear
+  bool write(ConfigKey key, uint8_t version, const void* data, uint16_t size);
+
+private:
+  uint32_t _base = 0;
+  uint8_t _active_page = 0;
+  uint32_t _sequence = 0;
+  uint32_t _write_offset = 0;
+
+  // Flash address of the newest record for each key, 0 if it's never been written
+  uint32_t _records[(uint16_t)ConfigKey::count] = {};
+
+  uint32_t page_address(uint8_t page) const;
+  uint8_t page_of(uint32_t address) const;
+
+  void format();
+  bool start_page(uint8_t page);
+
+  // Index the records in a page and return where the next one would go
+  uint32_t scan_page(uint8_t page);
+
+  // Move the live records out of a page and erase it
+  void recycle(uint8_t page);
+
+  // Start the next page in the ring, the oldest page is recycled to keep a spare
+  void advance();
+  bool append(ConfigKey key, uint8_t version, const void* data, uint16_t size);
+};
@@ -0,0 +1,20 @@
+/**
+ * @brief CRC-32 on the hardware CRC unit
+ * @note The CRC clock is enabled in main, the unit is left in its reset configuration
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+
+namespace crc {
+
+// Standard CRC-32 polynomial without the final inversion, fed a byte at a time so any alignment works
+uint32_t crc32(const void* data, uint32_t size);
+
+// Carry on from a previous result so a record can be checked in pieces
+uint32_t crc32(const void* data, uint32_t size, uint32_t initial);
+
+
+} // namespace crc
@@ -17,6 +17,9 @@ public:
 
   bool set_resistance(uint32_t resistance);
 
+  // Wiper tap for a resistance in ohms
+  static uint8_t resistance_to_tap(uint32_t resistance);
+
 private:
   I2C& _i2c_port;
   uint8_t _addr;
@@ -4,6 +4,10 @@
 
 #include <stdint.h>
 
+#include "calibration.h"
+#include "load_profile.h"
+#include "units.h"
+
 #pragma once
 
 
@@ -11,17 +15,33 @@ enum class LoadMode {
   unknown = 0,
   disabled,
   sense_voltage,
-  load_power
+  load_power,
+  load_bypass  // 48V supplies feed the load with the boost off
 };
 
 
 class DishyPower {
 public:
-  void init();
+  // Uses the calibration if it's current, otherwise measures it and fills it in to be saved
+  void init(Calibration& calibration);
   void tick();
 
   void enable_power();
   void disable_power();
+  bool is_power_enabled() const { return _power_output_enabled; };
+
+  // Measured output power in milliwatts, averaged and with a slowly decaying peak
+  uint32_t output_power() const { return _output_power_mw; };
+  uint32_t peak_output_power() const { return _peak_output_power_mw; };
+
+  // How long the dish has been drawing power in milliseconds, 0 if the load switch is off
+  uint32_t load_time() const;
+
+  // Thresholds used to track the dish come from the load profile
+  void set_load_profile(const LoadProfile& profile) { _profile = &profile; };
+
+  // Contract voltage the output is fed from, picks between boosting and bypassing the boost
+  void set_supply_voltage(units::millivolts voltage) { _supply_voltage = voltage; };
 
 private:
   bool _power_output_enabled = false;
@@ -36,16 +56,30 @@ private:
   uint32_t _current_no_load_counts = 0;
   uint32_t _current_below_thresh_counts = 0;
 
+  uint16_t _gain_q12 = ADC_GAIN_ONE_Q12;
+
+  uint32_t _output_power_mw = 0;
+  uint32_t _peak_output_power_mw = 0;
+  uint32_t _peak_decay_time = 0;
+
   LoadMode _current_mode = LoadMode::unknown;
+  const LoadProfile* _profile = &load_profile(DEFAULT_LOAD_PROFILE);
+  uint32_t _load_start_time = 0;
+  units::millivolts _supply_voltage = 0;
 
   void set_load_mode(LoadMode mode);
   void set_boost(bool enabled);
 
   void set_sense_mode();
   void set_load_power_mode();
+  void set_load_bypass_mode();
 
   void run_adc_conversion();
 
+  // First boot only, work out the gain from the internal reference and average the no load current
+  void measure_calibration(Calibration& calibration);
+  uint32_t measure_vrefint();
+
   void monitor_current();
   void monitor_sense_voltage();
 };
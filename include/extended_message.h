@@ -0,0 +1,62 @@
+/**
+ * @brief Reassembly of chunked PD 3.x extended messages
+ * @note Buffers come from a fixed pool shared by every port and are only held while a message is arriving
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "pd_protocol.h"
+
+// Messages that can be in reassembly at once across all ports
+#define EXTENDED_MESSAGE_POOL_SIZE 2
+
+// tChunkSenderResponse, a partly received message is dropped if the next chunk takes longer
+#define EXTENDED_MESSAGE_CHUNK_TIMEOUT_MS 30
+
+// Header, extended header and two bytes of padding
+#define PD_CHUNK_REQUEST_SIZE (PD_HEADER_SIZE + PD_DATA_OBJECT_SIZE)
+
+
+struct ExtendedMessage {
+  uint8_t data[PD_MAX_EXTENDED_MSG_LEN];
+  uint16_t size = 0;
+  uint16_t received = 0;
+  ExtendedMessageType type = ExtendedMessageType::reserved;
+  bool in_use = false;
+};
+
+enum class ChunkStatus : uint8_t {
+  complete = 0,  // The whole message is in message()
+  need_chunk,    // Send a chunk request for next_chunk()
+  dropped        // Malformed, out of order or the pool is empty
+};
+
+
+class ExtendedMessageReceiver {
+public:
+  ~ExtendedMessageReceiver() { release(); };
+
+  // Takes one received message with the extended bit set, headers included
+  ChunkStatus receive(const uint8_t* message, uint32_t size);
+
+  // Give the buffer back once a complete message is handled or the port resets
+  void release();
+
+  // Drop a message whose next chunk didn't show up in time
+  void check_timeout();
+
+  const ExtendedMessage* message() const { return _message; };
+  ExtendedMessageType type() const { return _type; };
+  uint8_t next_chunk() const { return _next_chunk; };
+
+private:
+  ExtendedMessage* _message = 0;
+  ExtendedMessageType _type = ExtendedMessageType::reserved;
+  uint8_t _next_chunk = 0;
+  uint32_t _chunk_time = 0;
+};
+
+// Chunk request asking the sender for the next part of a message, buffer must hold PD_CHUNK_REQUEST_SIZE
+void encode_chunk_request(uint8_t* buffer, ExtendedMessageType type, SpecificationRev spec_rev, uint8_t message_id, uint8_t chunk_number);
@@ -0,0 +1,30 @@
+/**
+ * @brief Erase and program the internal flash
+ * @note Only meant for the second bank, code runs from the first so it keeps running while the second is busy
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define FLASH_PAGE_SHIFT 11
+#define FLASH_PAGE_SIZE (1 << FLASH_PAGE_SHIFT)
+#define FLASH_BANK_2_BASE 0x08040000
+
+// Bank 2 pages carry on from 256 in the page number
+#define FLASH_BANK_2_FIRST_PAGE 256
+
+// Programming is done a double word at a time
+#define FLASH_PROGRAM_SIZE 8
+
+
+namespace flash {
+
+// Erase the page holding an address, false on an error
+bool erase_page(uint32_t address);
+
+// Program whole double words to an erased, double word aligned address, false on an error
+bool program(uint32_t address, const void* data, uint32_t size);
+
+
+} // namespace flash
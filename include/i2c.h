@@ -1,25 +1,33 @@
 /**
  * @brief Basic I2C driver
  * @note This is a blocking driver
- * @note Defaults to Fast Mode+
+ * @note No default speed, Fast Mode+ needs Fm+ drive and pull ups that most buses don't have
  * @note Defaults to master mode
  * @note Defaults to 7 bit addresses
  */
 
 #include <stdint.h>
 
+#include "i2c_timing.h"
+
 #pragma once
 
 class I2C {
 public:
-  I2C(uint8_t i2c_number) : _i2c_number(i2c_number) {}
+  I2C(uint8_t i2c_number, I2CSpeed speed) : _i2c_number(i2c_number), _speed(speed) {}
 
   void init();
 
+  // Can be called at any time, the peripheral is briefly disabled to update the timing
+  void set_speed(I2CSpeed speed);
+  I2CSpeed speed() const { return _speed; }
+
   int write_to(uint8_t addr, uint8_t reg, const uint8_t* data, uint32_t len);
   int read_from(uint8_t addr, uint8_t reg, uint8_t* data, uint32_t len);
 
 private:
   uint8_t _i2c_number;
+  I2CSpeed _speed;
   uint32_t _base_addr = 0;
+  uint32_t _kernel_clock_hz = 0;
 };
@@ -0,0 +1,115 @@
+/**
+ * @brief Compile time calculator for the I2C TIMINGR register
+ * @note All math is done in picoseconds so it should only ever be evaluated at compile time
+ */
+
+#include <stdint.h>
+
+#pragma once
+
+
+enum class I2CSpeed : uint8_t {
+  standard = 0,  // 100 kHz
+  fast,          // 400 kHz
+  fast_plus      // 1 MHz
+};
+
+
+namespace i2c_timing {
+
+
+// Minimum analog filter delay, shortens the required data hold time
+#define I2C_ANALOG_FILTER_MIN_NS 50
+
+// Bus timing limits from the I2C spec for each speed mode
+struct ModeSpec {
+  uint32_t freq_hz;
+  uint32_t low_min_ns;
+  uint32_t high_min_ns;
+  uint32_t su_dat_min_ns;
+  uint32_t vd_dat_max_ns;
+};
+
+constexpr ModeSpec mode_spec(I2CSpeed speed) {
+  return speed == I2CSpeed::standard ? ModeSpec{100000, 4700, 4000, 250, 3450} :
+         speed == I2CSpeed::fast     ? ModeSpec{400000, 1300, 600, 100, 900} :
+                                       ModeSpec{1000000, 500, 260, 50, 450};
+}
+
+constexpr uint64_t div_ceil(uint64_t num, uint64_t den) { return (num + den - 1) / den; }
+constexpr uint64_t sub_floor(uint64_t a, uint64_t b) { return a > b ? a - b : 0; }
+constexpr uint64_t max_of(uint64_t a, uint64_t b) { return a > b ? a : b; }
+
+constexpr uint64_t clock_ps(uint32_t clock_hz) {
+  return 1000000000000ull / clock_hz;
+}
+
+constexpr uint64_t presc_ps(uint32_t clock_hz, uint32_t presc) {
+  return (presc + 1) * clock_ps(clock_hz);
+}
+
+// Number of prescaled ticks available for SCL low + high once the edges are removed
+constexpr uint64_t period_ticks(uint32_t clock_hz, I2CSpeed speed, uint32_t rise_ns, uint32_t fall_ns, uint32_t presc) {
+  return div_ceil(sub_floor(1000000000000ull / mode_spec(speed).freq_hz, (rise_ns + fall_ns) * 1000ull), presc_ps(clock_hz, presc));
+}
+
+// Split the period in the same ratio as the spec minimums
+constexpr uint64_t scll_ticks(uint32_t clock_hz, I2CSpeed speed, uint32_t rise_ns, uint32_t fall_ns, uint32_t presc) {
+  return max_of(
+    div_ceil(mode_spec(speed).low_min_ns * 1000ull, presc_ps(clock_hz, presc)),
+    period_ticks(clock_hz, speed, rise_ns, fall_ns, presc) * mode_spec(speed).low_min_ns /
+      (mode_spec(speed).low_min_ns + mode_spec(speed).high_min_ns)
+  );
+}
+
+constexpr uint64_t sclh_ticks(uint32_t clock_hz, I2CSpeed speed, uint32_t rise_ns, uint32_t fall_ns, uint32_t presc) {
+  return max_of(
+    div_ceil(mode_spec(speed).high_min_ns * 1000ull, presc_ps(clock_hz, presc)),
+    sub_floor(period_ticks(clock_hz, speed, rise_ns, fall_ns, presc), scll_ticks(clock_hz, speed, rise_ns, fall_ns, presc))
+  );
+}
+
+// SDADEL * tPRESC >= tf - tAF(min) - 3 * tI2CCLK
+constexpr uint64_t sdadel(uint32_t clock_hz, uint32_t fall_ns, uint32_t presc) {
+  return div_ceil(sub_floor(fall_ns * 1000ull, I2C_ANALOG_FILTER_MIN_NS * 1000ull + 3 * clock_ps(clock_hz)), presc_ps(clock_hz, presc));
+}
+
+// (SCLDEL + 1) * tPRESC >= tr + tSU;DAT(min)
+constexpr uint64_t scldel_ticks(uint32_t clock_hz, I2CSpeed speed, uint32_t rise_ns, uint32_t presc) {
+  return div_ceil((rise_ns + mode_spec(speed).su_dat_min_ns) * 1000ull, presc_ps(clock_hz, presc));
+}
+
+constexpr bool fits(uint32_t clock_hz, I2CSpeed speed, uint32_t rise_ns, uint32_t fall_ns, uint32_t presc) {
+  return scll_ticks(clock_hz, speed, rise_ns, fall_ns, presc) <= 256 &&
+         sclh_ticks(clock_hz, speed, rise_ns, fall_ns, presc) <= 256 &&
+         sdadel(clock_hz, fall_ns, presc) <= 15 &&
+         scldel_ticks(clock_hz, speed, rise_ns, presc) <= 16 &&
+         // Data has to be valid before the spec's tVD;DAT(max)
+         sdadel(clock_hz, fall_ns, presc) * presc_ps(clock_hz, presc) + rise_ns * 1000ull + 4 * clock_ps(clock_hz) <=
+           mode_spec(speed).vd_dat_max_ns * 1000ull;
+}
+
+constexpr uint32_t encode(uint32_t clock_hz, I2CSpeed speed, uint32_t rise_ns, uint32_t fall_ns, uint32_t presc) {
+  return (presc << 28) |
+         ((uint32_t)(scldel_ticks(clock_hz, speed, rise_ns, presc) - 1) << 20) |
+         ((uint32_t)sdadel(clock_hz, fall_ns, presc) << 16) |
+         ((uint32_t)(sclh_ticks(clock_hz, speed, rise_ns, fall_ns, presc) - 1) << 8) |
+         (uint32_t)(scll_ticks(clock_hz, speed, rise_ns, fall_ns, presc) - 1);
+}
+
+// Use the smallest prescaler that fits to get the best resolution
+constexpr uint32_t search(uint32_t clock_hz, I2CSpeed speed, uint32_t rise_ns, uint32_t fall_ns, uint32_t presc) {
+  return presc > 15 ? 0 :
+         fits(clock_hz, speed, rise_ns, fall_ns, presc) ? encode(clock_hz, speed, rise_ns, fall_ns, presc) :
+         search(clock_hz, speed, rise_ns, fall_ns, presc + 1);
+}
+
+
+} // namespace i2c_timing
+
+
+// Calculate TIMINGR for the given kernel clock, bus speed and edge times
+// Returns 0 if the timing can not be met
+constexpr uint32_t i2c_timingr(uint32_t clock_hz, I2CSpeed speed, uint32_t rise_ns, uint32_t fall_ns) {
+  return i2c_timing::search(clock_hz, speed, rise_ns, fall_ns, 0);
+}
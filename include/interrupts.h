@@ -0,0 +1,19 @@
+/**
+ * @brief Masking interrupts around state shared between the main loop and the ISRs
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+
+// Returns the old mask so sections can nest
+inline uint32_t disable_interrupts() {
+  uint32_t primask;
+  asm volatile("mrs %0, primask\n cpsid i" : "=r" (primask) :: "memory");
+  return primask;
+}
+
+inline void restore_interrupts(uint32_t primask) {
+  asm volatile("msr primask, %0" :: "r" (primask) : "memory");
+}
@@ -0,0 +1,68 @@
+/**
+ * @brief Power requirements and sense thresholds for each dish model
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "units.h"
+
+
+enum class LoadProfileId : uint8_t {
+  standard = 0,  // Round dish, needs the full output power
+  low_power,     // Rectangular dish, runs from a single 65W charger
+  count
+};
+
+// Profile used when one isn't picked at runtime, e.g. bazel build --copt=-DDEFAULT_LOAD_PROFILE=LoadProfileId::low_power
+#ifndef DEFAULT_LOAD_PROFILE
+#define DEFAULT_LOAD_PROFILE LoadProfileId::standard
+#endif
+
+// Output power each dish needs, also used to build the sink capabilities at compile time
+#define STANDARD_REQUIRED_POWER_MW 93000
+#define LOW_POWER_REQUIRED_POWER_MW 55000
+
+// How long the dish has to be drawing power before its load signature is checked
+#define LOAD_PROFILE_DETECT_WINDOW_MS 5000
+
+
+struct LoadProfile {
+  const char* name;
+
+  // Output power the contracts have to cover
+  units::milliwatts required_power;
+
+  // Smallest output power measured load admission will try the dish on
+  units::milliwatts admit_power;
+
+  // Boost regulation point and how far under it the load switch can close, high side ADC counts
+  uint32_t output_counts;
+  uint32_t output_buffer_counts;
+
+  // Output power that has to be drawn to count the dish as still connected
+  units::milliwatts disconnect_power;
+
+  // Sense line voltage window that marks a connected dish, low side ADC counts
+  uint32_t sense_counts;
+  uint32_t sense_window_counts;
+
+  // Range of the peak load during the detect window that picks this profile
+  units::milliwatts detect_min_power;
+  units::milliwatts detect_max_power;
+};
+
+
+const LoadProfile& load_profile(LoadProfileId id);
+
+// Compile time copy of LoadProfile::required_power
+constexpr units::milliwatts load_profile_required_power(LoadProfileId id) {
+  return id == LoadProfileId::low_power ? LOW_POWER_REQUIRED_POWER_MW : STANDARD_REQUIRED_POWER_MW;
+}
+
+// Match the peak load seen during the detect window, falls back to the standard dish
+LoadProfileId detect_load_profile(units::milliwatts peak_power);
+
+// Profile with the lowest requirement, used to bring the output up before the dish has been identified
+LoadProfileId lightest_load_profile();
@@ -0,0 +1,55 @@
+/**
+ * @brief Fixed pool of PD message blocks shared by every port for both RX and TX
+ * @note Queues and DMA hold block indices so a message is never copied once it's in a block
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define PD_BUFFER_SIZE 32
+
+// Most blocks one port can hold so a busy port can't starve the other
+// The RX DMA always holds one, leaving 9 for the RX and TX queues and a pending AMS together. That's less
+// than the 9 RX plus 9 TX each port had to itself before, a port with both queues backed up drops past it
+#define MESSAGE_POOL_PORT_QUOTA 10
+
+// Ports are numbered by PDPort
+#define MESSAGE_POOL_OWNERS 3
+
+// Blocks across all ports, enough for every port at its full quota at once
+#define MESSAGE_POOL_BLOCKS (MESSAGE_POOL_PORT_QUOTA * (MESSAGE_POOL_OWNERS - 1))
+
+#define MESSAGE_POOL_NO_BLOCK 0xFF
+
+
+struct PDMessage {
+  uint8_t buffer[PD_BUFFER_SIZE];
+  uint8_t size;
+};
+
+
+namespace message_pool {
+
+
+// Take a free block, MESSAGE_POOL_NO_BLOCK when the pool or the owner's quota is used up
+// Safe from the main loop and interrupts
+uint8_t acquire(uint8_t owner);
+
+// Releasing a block that isn't held is ignored and counted so a bad path can't hand a block out twice
+void release(uint8_t block);
+
+PDMessage& message(uint8_t block);
+
+// Most blocks held at once since boot, in total and by one owner
+uint8_t high_water();
+uint8_t high_water(uint8_t owner);
+
+// Acquires that failed, each one is a message that was dropped
+uint32_t dropped();
+
+// Reports over RTT when the high water mark or the drop count goes up
+void tick();
+
+
+} // namespace message_pool
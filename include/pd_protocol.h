@@ -7,17 +7,26 @@
 
 #include <stdint.h>
 
-#include "registers/helpers.h"
-
 #define MAX_CAPABILITIES 7
 
+// EPR source caps carry the 7 SPR positions followed by up to 4 EPR ones
+#define MAX_EPR_CAPABILITIES 11
+#define EPR_FIRST_CAPABILITY 7
+
 
 // Enum for different power data object types in a source caps message
 enum class PowerDataObjectType : uint8_t {
   fixed = 0,
   battery = 1,
   variable = 2,
-  reserved = 3
+  augmented = 3  // PD 3.x APDOs, the augmented type picks the kind
+};
+
+enum class AugmentedPowerDataObjectType : uint8_t {
+  pps = 0,
+  epr_avs,
+  spr_avs,
+  reserved
 };
 
 enum class ControlMessageType : uint8_t {
@@ -34,7 +43,16 @@ enum class ControlMessageType : uint8_t {
   pr_swap,
   vconn_swap,
   wait,
-  soft_reset
+  soft_reset,
+
+  // PD 3.x only
+  not_supported = 0x10,
+  get_source_cap_extended,
+  get_status,
+  fr_swap,
+  get_pps_status,
+  get_country_codes,
+  get_sink_cap_extended
 };
 
 enum class DataMessageType : uint8_t {
@@ -43,128 +61,407 @@ enum class DataMessageType : uint8_t {
   request,
   bist,
   sink_capabilities,
+
+  // PD 3.x only
+  battery_status,
+  alert,
+  get_country_info,
+  enter_usb,
+  epr_request,
+  epr_mode,
   vendor_defined = 0xF
 };
 
+// Carried with the extended bit set in the header, PD 3.x only
+enum class ExtendedMessageType : uint8_t {
+  reserved = 0,
+  source_capabilities_extended,
+  status,
+  get_battery_cap,
+  get_battery_status,
+  battery_capabilities,
+  get_manufacturer_info,
+  manufacturer_info,
+  security_request,
+  security_response,
+  firmware_update_request,
+  firmware_update_response,
+  pps_status,
+  country_info,
+  country_codes,
+  sink_capabilities_extended,
+  extended_control,
+  epr_source_capabilities,
+  epr_sink_capabilities
+};
+
+enum class ExtendedControlType : uint8_t {
+  reserved = 0,
+  epr_get_source_cap,
+  epr_get_sink_cap,
+  epr_keep_alive,
+  epr_keep_alive_ack
+};
+
+enum class EPRModeAction : uint8_t {
+  reserved = 0,
+  enter,
+  enter_acknowledged,
+  enter_succeeded,
+  enter_failed,
+  exit
+};
+
 enum class SpecificationRev : uint8_t {
   one_v_zero = 0,
   two_v_zero,
+  three_v_zero,
   reserved
 };
 
+// Highest revision spoken, partners are talked to at the lower of theirs and this
+#define PD_SPEC_REV SpecificationRev::three_v_zero
+
+#define PD_HEADER_SIZE 2
+#define PD_DATA_OBJECT_SIZE 4
+
+// tPPSRequest is 10s, request again well inside it
+#define PPS_KEEP_ALIVE_MS 5000
+
+// tSinkEPRKeepAlive is 500ms, the source hard resets without one
+#define EPR_KEEP_ALIVE_MS 250
+
+#define PD_EXTENDED_HEADER_SIZE 2
+#define PD_MAX_EXTENDED_MSG_LEN 260
+#define PD_MAX_EXTENDED_MSG_CHUNK_LEN 26
+
+// Shift and mask access to a field within a PD header or data object
+template <uint8_t POS, uint8_t WIDTH>
+struct BitField {
+  static constexpr uint32_t mask() { return (uint32_t)((1ull << WIDTH) - 1); }
+  static constexpr uint32_t get(uint32_t word) { return (word >> POS) & mask(); }
+  static constexpr uint32_t set(uint32_t value) { return (value & mask()) << POS; }
+  static constexpr uint32_t replace(uint32_t word, uint32_t value) { return (word & ~(mask() << POS)) | set(value); }
+};
+
 // PD Message Header
-struct PACKED MessageHeader {
-  uint8_t message_type: 4;
-  uint8_t : 1;
-  uint8_t port_data_role: 1;
-  uint8_t spec_rev: 2;
-  uint8_t power_port_role: 1;
-  uint8_t message_id: 3;
-  uint8_t num_data_obj: 3;
-  uint8_t : 1;
+namespace header {
+
+typedef BitField<0, 5>  MessageType;
+typedef BitField<5, 1>  PortDataRole;
+typedef BitField<6, 2>  SpecRev;
+typedef BitField<8, 1>  PortPowerRole;
+typedef BitField<9, 3>  MessageID;
+typedef BitField<12, 3> NumDataObjects;
+typedef BitField<15, 1> Extended;
+
+constexpr uint16_t encode(uint8_t message_type, SpecificationRev spec_rev, uint8_t message_id, uint8_t num_data_obj) {
+  return MessageType::set(message_type) |
+         SpecRev::set((uint8_t)spec_rev) |
+         MessageID::set(message_id) |
+         NumDataObjects::set(num_data_obj);
+}
+
+constexpr uint16_t encode_extended(uint8_t message_type, SpecificationRev spec_rev, uint8_t message_id, uint8_t num_data_obj) {
+  return encode(message_type, spec_rev, message_id, num_data_obj) | Extended::set(1);
+}
+
+// Revision to use with a partner given the header of a message it sent
+constexpr SpecificationRev negotiate_spec_rev(uint16_t partner_header) {
+  return SpecRev::get(partner_header) < (uint8_t)PD_SPEC_REV ? (SpecificationRev)SpecRev::get(partner_header) : PD_SPEC_REV;
+}
+
+} // namespace header
+
+// Follows the message header of every extended message
+namespace extended_header {
+
+typedef BitField<0, 9>  DataSize;
+typedef BitField<10, 1> RequestChunk;
+typedef BitField<11, 4> ChunkNumber;
+typedef BitField<15, 1> Chunked;
+
+constexpr uint16_t encode(uint16_t data_size, uint8_t chunk_number, bool request_chunk) {
+  return Chunked::set(1) |
+         ChunkNumber::set(chunk_number) |
+         RequestChunk::set(request_chunk) |
+         DataSize::set(data_size);
+}
+
+} // namespace extended_header
+
+// Data object of an EPR_Mode message
+namespace epr_mode_do {
+
+typedef BitField<16, 8> Data;  // Operational PDP in watts when entering
+typedef BitField<24, 8> Action;
+
+constexpr uint32_t encode(EPRModeAction action, uint8_t data) {
+  return Action::set((uint8_t)action) | Data::set(data);
+}
+
+} // namespace epr_mode_do
+
+// Data object of an Alert message, the source follows up with a Status message when asked
+namespace alert_do {
+
+typedef BitField<25, 1> BatteryStatusChange;
+typedef BitField<26, 1> OverCurrent;
+typedef BitField<27, 1> OverTemperature;
+typedef BitField<28, 1> OperatingConditionChange;
+typedef BitField<29, 1> SourceInputChange;
+typedef BitField<30, 1> OverVoltage;
+
+} // namespace alert_do
+
+// Byte offsets into the Source_Capabilities_Extended data block
+#define SCEDB_SOURCE_PDP_OFFSET 23
+
+// Byte offsets into the Status data block, PD 3.0 sources may stop short of the power status
+#define SDB_INTERNAL_TEMP_OFFSET 0
+#define SDB_EVENT_FLAGS_OFFSET 3
+#define SDB_TEMPERATURE_STATUS_OFFSET 4
+#define SDB_POWER_STATUS_OFFSET 5
+
+namespace status_db {
+
+// Event flags
+typedef BitField<1, 1> OverCurrent;
+typedef BitField<2, 1> OverTemperature;
+typedef BitField<3, 1> OverVoltage;
+typedef BitField<4, 1> CurrentLimited;  // PPS supply running in current foldback
+
+// Temperature status
+typedef BitField<1, 2> TemperatureStatus;
+
+// Power status
+typedef BitField<1, 1> CableLimited;
+typedef BitField<2, 1> SharedLimited;     // Power is being shared with the source's other ports
+typedef BitField<3, 1> ExternalLimited;
+
+} // namespace status_db
+
+enum class TemperatureStatus : uint8_t {
+  not_supported = 0,
+  normal,
+  warning,
+  over_temperature
 };
 
-// Source capability PDOs
-struct PACKED FixedPowerDataObject {
-  uint16_t max_current_10ma: 10;
-  uint16_t voltage_50mv: 10;
-  uint16_t peak_current: 2;
-  uint16_t : 3;
-  uint16_t dual_role_data: 1;
-  uint16_t usb_comm_cap: 1;
-  uint16_t uncon_power: 1;
-  uint16_t suspend_sup: 1;
-  uint16_t dual_role_power: 1;
-  uint16_t supply_type: 2;
-};
-
-struct PACKED BatteryPowerDataObject {
-  uint16_t max_power_250mw: 10;
-  uint16_t min_voltage_50mv: 10;
-  uint16_t max_voltage_50mv: 10;
-  uint16_t  supply_type: 2;
-};
-
-struct PACKED VariablePowerDataObject {
-  uint16_t max_current_10ma: 10;
-  uint16_t min_voltage_50mv: 10;
-  uint16_t max_voltage_50mv: 10;
-  uint16_t  supply_type: 2;
-};
-
-// Source request PDOs
-struct PACKED FixedRequestPowerDataObject {
-  uint16_t max_current_10ma: 10;
-  uint16_t op_current_10ma: 10;
-  uint8_t : 4;
-  uint8_t no_usb_sus: 1;
-  uint8_t usb_comm_cap: 1;
-  uint8_t cap_missmatch: 1;
-  uint8_t give_back: 1;
-  uint8_t object_pos: 3;
-  uint8_t :1;
-};
-
-struct PACKED BatteryRequestPowerDataObject {
-  uint16_t max_power_250mw: 10;
-  uint16_t op_power_250mw: 10;
-  uint8_t : 4;
-  uint8_t no_usb_sus: 1;
-  uint8_t usb_comm_cap: 1;
-  uint8_t cap_missmatch: 1;
-  uint8_t give_back: 1;
-  uint8_t object_pos: 3;
-  uint8_t :1;
-};
-
-// Each PDO is 32 bits
-struct PACKED PowerDataObject {
-  uint32_t : 30;
-  uint8_t supply_type : 2;
-};
-
-// Factories for sink cap requests
-void vsafe5v_basic_sink_cap(uint8_t* buffer, uint32_t buffer_size, uint32_t* bytes_written);
+// Common to every PDO
+typedef BitField<30, 2> SupplyType;
 
+// Source capability PDOs
+namespace fixed_pdo {
+
+typedef BitField<0, 10>  MaxCurrent10mA;
+typedef BitField<10, 10> Voltage50mV;
+typedef BitField<20, 2>  PeakCurrent;
+typedef BitField<25, 1>  DualRoleData;
+typedef BitField<26, 1>  USBCommCapable;
+typedef BitField<27, 1>  UnconstrainedPower;
+typedef BitField<23, 1>  EPRModeCapable;    // Source PDOs, only meaningful on vSafe5V
+typedef BitField<28, 1>  SuspendSupported;  // Higher capability for sink PDOs
+typedef BitField<29, 1>  DualRolePower;
+
+constexpr uint32_t encode(uint32_t voltage_50mv, uint32_t max_current_10ma) {
+  return SupplyType::set((uint8_t)PowerDataObjectType::fixed) |
+         Voltage50mV::set(voltage_50mv) |
+         MaxCurrent10mA::set(max_current_10ma);
+}
+
+} // namespace fixed_pdo
+
+namespace battery_pdo {
+
+typedef BitField<0, 10>  MaxPower250mW;
+typedef BitField<10, 10> MinVoltage50mV;
+typedef BitField<20, 10> MaxVoltage50mV;
+
+constexpr uint32_t encode(uint32_t min_voltage_50mv, uint32_t max_voltage_50mv, uint32_t max_power_250mw) {
+  return SupplyType::set((uint8_t)PowerDataObjectType::battery) |
+         MaxVoltage50mV::set(max_voltage_50mv) |
+         MinVoltage50mV::set(min_voltage_50mv) |
+         MaxPower250mW::set(max_power_250mw);
+}
+
+} // namespace battery_pdo
+
+namespace variable_pdo {
+
+typedef BitField<0, 10>  MaxCurrent10mA;
+typedef BitField<10, 10> MinVoltage50mV;
+typedef BitField<20, 10> MaxVoltage50mV;
+
+constexpr uint32_t encode(uint32_t min_voltage_50mv, uint32_t max_voltage_50mv, uint32_t max_current_10ma) {
+  return SupplyType::set((uint8_t)PowerDataObjectType::variable) |
+         MaxVoltage50mV::set(max_voltage_50mv) |
+         MinVoltage50mV::set(min_voltage_50mv) |
+         MaxCurrent10mA::set(max_current_10ma);
+}
+
+} // namespace variable_pdo
+
+// Programmable power supply APDOs
+namespace pps_apdo {
+
+typedef BitField<28, 2>  AugmentedType;
+typedef BitField<0, 7>   MaxCurrent50mA;
+typedef BitField<8, 8>   MinVoltage100mV;
+typedef BitField<17, 8>  MaxVoltage100mV;
+typedef BitField<27, 1>  PowerLimited;
+
+constexpr uint32_t encode(uint32_t min_voltage_100mv, uint32_t max_voltage_100mv, uint32_t max_current_50ma) {
+  return SupplyType::set((uint8_t)PowerDataObjectType::augmented) |
+         AugmentedType::set((uint8_t)AugmentedPowerDataObjectType::pps) |
+         MaxVoltage100mV::set(max_voltage_100mv) |
+         MinVoltage100mV::set(min_voltage_100mv) |
+         MaxCurrent50mA::set(max_current_50ma);
+}
+
+} // namespace pps_apdo
+
+// Source request data objects
+namespace request_do {
+
+// Shared by all RDO types
+typedef BitField<22, 1> EPRModeCapable;
+typedef BitField<24, 1> NoUSBSuspend;
+typedef BitField<25, 1> USBCommCapable;
+typedef BitField<26, 1> CapabilityMismatch;
+typedef BitField<27, 1> GiveBack;
+typedef BitField<28, 4> ObjectPosition;  // EPR positions run past 7
+
+// Fixed and variable supplies
+typedef BitField<0, 10>  MaxCurrent10mA;
+typedef BitField<10, 10> OpCurrent10mA;
+
+// Battery supplies
+typedef BitField<0, 10>  MaxPower250mW;
+typedef BitField<10, 10> OpPower250mW;
+
+// Programmable supplies
+typedef BitField<0, 7>   OpCurrent50mA;
+typedef BitField<9, 12>  OutputVoltage20mV;
+
+constexpr uint32_t encode_fixed(uint8_t object_position, uint32_t op_current_10ma, uint32_t max_current_10ma) {
+  return ObjectPosition::set(object_position) |
+         OpCurrent10mA::set(op_current_10ma) |
+         MaxCurrent10mA::set(max_current_10ma);
+}
+
+constexpr uint32_t encode_battery(uint8_t object_position, uint32_t op_power_250mw, uint32_t max_power_250mw) {
+  return ObjectPosition::set(object_position) |
+         OpPower250mW::set(op_power_250mw) |
+         MaxPower250mW::set(max_power_250mw);
+}
+
+constexpr uint32_t encode_pps(uint8_t object_position, uint32_t output_voltage_20mv, uint32_t op_current_50ma) {
+  return ObjectPosition::set(object_position) |
+         OutputVoltage20mV::set(output_voltage_20mv) |
+         OpCurrent50mA::set(op_current_50ma);
+}
+
+} // namespace request_do
+
+// Little endian wire access, identical on host and target regardless of buffer alignment
+inline uint16_t load_le16(const uint8_t* buffer) {
+  return (uint16_t)(buffer[0] | (buffer[1] << 8));
+}
+
+inline uint32_t load_le32(const uint8_t* buffer) {
+  return (uint32_t)buffer[0] | ((uint32_t)buffer[1] << 8) | ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+inline void store_le16(uint8_t* buffer, uint16_t value) {
+  buffer[0] = value & 0xFF;
+  buffer[1] = value >> 8;
+}
+
+inline void store_le32(uint8_t* buffer, uint32_t value) {
+  buffer[0] = value & 0xFF;
+  buffer[1] = (value >> 8) & 0xFF;
+  buffer[2] = (value >> 16) & 0xFF;
+  buffer[3] = value >> 24;
+}
 
 // Forward declarations
 class Request;
 class USBPDController;
 
 // Classes representing different data messages from the source
+// Wraps a raw PDO as received and decodes it on demand
 class SourceCapability {
 public:
   SourceCapability() {};
-  SourceCapability(const PowerDataObject& object, uint8_t index);
+  SourceCapability(uint32_t pdo, uint8_t index) : _pdo(pdo), _index(index) {};
 
-  PowerDataObjectType type() const { return _pdo_type; };
-  uint32_t voltage() const { return _voltage; };
-  uint32_t max_power() const { return _power; };
-  uint32_t current() const { return _current; }
+  PowerDataObjectType type() const { return (PowerDataObjectType)SupplyType::get(_pdo); };
+  uint32_t voltage() const;
+  uint32_t max_power() const;
+  uint32_t current() const;
   bool is_battery() const;
+  bool is_pps() const;
   uint8_t index() const { return _index; };
+  uint32_t pdo() const { return _pdo; };
+
+  // Output range, a single voltage for fixed supplies
+  uint32_t min_voltage() const;
+  uint32_t max_voltage() const;
+
+  // PPS supplies run at the top of their range unless programmed, anything else is returned as is
+  SourceCapability programmed(uint32_t voltage) const;
 
 private:
-  PowerDataObjectType _pdo_type = PowerDataObjectType::reserved;
-  uint32_t _voltage = 0;
-  uint32_t _current = 0;
-  uint32_t _power = 0;
+  uint32_t _pdo = 0;
   uint8_t _index = 0;
+  uint16_t _voltage_20mv = 0;
+
+  // Battery and variable supplies are treated as running at the middle of their range
+  uint32_t median_voltage_50mv() const;
 };
 
 
 class SourceCapabilities {
 public:
   SourceCapabilities() {};
-  SourceCapabilities(const PowerDataObject* objects, uint8_t object_count);
-  const SourceCapability* caps() const { return _capabilities; };
+  // PDOs are copied out of the message bytewise so the buffer doesn't need to be aligned
+  SourceCapabilities(const uint8_t* objects, uint8_t object_count);
+
+  // Returns an empty capability if the index is out of range
+  SourceCapability cap(uint8_t index) const;
+  uint32_t pdo(uint8_t index) const { return _pdos[index]; };
   uint8_t count() const { return _capability_count; };
 
 private:
-  SourceCapability _capabilities[MAX_CAPABILITIES] = {};
+  uint32_t _pdos[MAX_EPR_CAPABILITIES] = {};
   uint8_t _capability_count = 0;
 };
 
+// What a PD 3.x source has said about its own condition, kept until the source resets or detaches
+struct SourceStatus {
+  // Source PDP in watts, 0 until Source_Capabilities_Extended arrives
+  uint8_t pdp = 0;
+
+  // Internal temperature in C, 0 if the source doesn't report it
+  uint8_t temperature = 0;
+  TemperatureStatus temperature_status = TemperatureStatus::not_supported;
+
+  bool over_current = false;
+  bool over_temperature = false;
+  bool over_voltage = false;
+  bool current_limited = false;
+  bool shared_limited = false;
+
+  // The source is close to throttling or tripping so the load should come off it
+  bool overloaded() const;
+
+  // Alerts only flag what changed, a Status message replaces the lot
+  void update_alert(uint32_t alert);
+  void update_status(const uint8_t* status, uint32_t size);
+  void update_extended_caps(const uint8_t* caps, uint32_t size);
+};
+
 // Classes representing data messages to the source
 class Request {
 public:
@@ -172,9 +469,13 @@ public:
 
   uint32_t generate_pdo();
 
+  // PPS contracts lapse unless they're requested again every PPS_KEEP_ALIVE_MS
+  bool needs_keep_alive() const { return _pdo_type == PowerDataObjectType::augmented; };
+
 private:
-  PowerDataObjectType _pdo_type = PowerDataObjectType::reserved;
+  PowerDataObjectType _pdo_type = PowerDataObjectType::fixed;
   uint32_t _voltage = 0;
+  uint32_t _max_current = 0;
   uint32_t _power = 0;
   uint32_t _pdo_index = 0;
 };
@@ -213,4 +514,7 @@ public:
   // Data events
   virtual void capabilities_received(IController& controller, const SourceCapabilities& caps) = 0;
 
+  // PD 3.x sources report their PDP and warn of overloads ahead of tripping
+  virtual void status_received(IController& controller, const SourceStatus& status) = 0;
+
 };
@@ -1,30 +1,175 @@
 /**
- * @brief Handles the muxing of power from both USB C ports
+ * @brief Handles the muxing of power from all of the USB C ports
  */
 
 #pragma once
 
+#include "boost_efficiency.h"
+#include "config_store.h"
 #include "dishy_power.h"
+#include "load_profile.h"
 #include "pd_protocol.h"
 #include "power_switch.h"
 
-#define REQUIRED_OUTPUT_POWER_MW 93000
+#define NO_CAPABILITY 0xFF
+#define NO_PORT 0xFF
 
+// Ports sharing the load get their proportional share plus 1/4 of their contract as headroom
+#define CURRENT_SHARE_PERIOD_MS 100
+#define CURRENT_SHARE_HEADROOM_SHIFT 2
+#define CURRENT_SHARE_HYSTERESIS_MA 100
 
-enum class ControllerIndex : uint8_t {
-  unknown = 0,
-  a,
-  b
+// Sources warning of an overload are held to 3/4 of their contract until the warning clears
+#define SOURCE_OVERLOAD_DERATE_SHIFT 2
+
+// Measured load admission sheds the output once the input draw reaches this much of the contracts
+#define LOAD_SHED_PERCENT 95
+
+// Plans remembered for the most recent sets of source caps, a reset this soon after the output comes
+// up counts against the plan that brought it up
+#define CONTRACT_CACHE_SIZE 8
+#define CONTRACT_CACHE_RESET_WINDOW_MS 2000
+
+// Bumped whenever the entry layout or the fingerprint changes, the port count is folded in as it sizes the plans
+#define CONTRACT_CACHE_LAYOUT 1
+#define CONTRACT_CACHE_VERSION ((CONTRACT_CACHE_LAYOUT << 4) | POWER_MUX_PORT_COUNT)
+
+// Number of USB C inputs feeding the output
+#ifndef POWER_MUX_PORT_COUNT
+#define POWER_MUX_PORT_COUNT 2
+#endif
+
+
+enum class NegotiationMode : uint8_t {
+  serial = 0,  // Each port waits for the ports before it to reach PS_RDY
+  parallel     // Every port is requested as soon as it has caps
+};
+
+
+enum class AdmissionMode : uint8_t {
+  budget = 0,  // Only enable the output when the contracts cover the profile's required power
+  measured     // Enable on a smaller contract and shed the load if the measured draw gets close to it
+};
+
+
+// The PD controller and power switch for one input, the controller can be an STMPD or a USBPDController
+struct PowerPortConfig {
+  IController& controller;
+  PowerSwitch& power_switch;
+};
+
+
+// Negotiation state for one input
+struct PowerPort {
+  IController* controller = 0;
+  PowerSwitch* power_switch = 0;
+
+  uint8_t selected_index = NO_CAPABILITY;
+  bool requested = false;
+  bool accepted = false;
+  bool ps_rdy = false;
+
+  // The controller still holds caps after a disconnect or reset so track if they're from a live source
+  bool caps_valid = false;
+
+  // The source sent new caps so a new request has to go out even if the index doesn't change
+  bool renegotiate = false;
+
+  // The port is moving to a new contract at the same voltage with its switch still on
+  bool in_place = false;
+
+  // Contract the supply is currently running, kept until PS_RDY for the next one
+  SourceCapability contract;
+
+  // Last current limit given to the power switch
+  uint32_t current_limit = 0;
+
+  // PDP and overload warnings from a PD 3.x source
+  SourceStatus status;
+
+  // Forget everything negotiated with the source
+  void reset();
+};
+
+
+// Which capability to request from each port, ports left out of the plan are parked on vSafe5V
+struct ContractPlan {
+  ContractPlan();
+
+  uint8_t index[POWER_MUX_PORT_COUNT];
+  uint32_t voltage = 0;
+  uint32_t power = 0;          // Drawn from the supplies
+  uint32_t output_power = 0;   // Delivered to the 48V output after the boost losses
+  uint32_t input_current = 0;  // Drawn from the supplies to carry the required output power
+  bool feasible = false;
+
+  bool uses(uint8_t port_number) const { return index[port_number] != NO_CAPABILITY; };
+  bool is_better_than(const ContractPlan& other) const;
+  bool same_as(const ContractPlan& other) const;
+
+  // Work out what the plan delivers through the boost
+  void evaluate(const BoostEfficiency& boost, uint32_t required_power);
+
+  // Search every ports capabilities for the best voltage matched set of contracts, ports without caps are null
+  // A workable plan at the hold voltage is preferred so a live output doesn't have to drop
+  static ContractPlan solve(const SourceCapabilities* const (&caps)[POWER_MUX_PORT_COUNT], uint32_t hold_voltage,
+                            const BoostEfficiency& boost, uint32_t required_power);
+
+  // Take the best fixed supply at the voltage from every port that has one
+  static ContractPlan at_voltage(const SourceCapabilities* const (&caps)[POWER_MUX_PORT_COUNT], uint32_t voltage);
+};
+
+
+enum class ContractOutcome : uint8_t {
+  pending = 0,  // Requested but the output isn't up on it yet
+  accepted,     // The output came up on it
+  rejected,
+  reset         // A source reset soon after the output came up
+};
+
+
+// Plan picked last time for a set of source caps and how it went
+struct ContractCacheEntry {
+  uint32_t fingerprint = 0;
+  ContractPlan plan;
+  ContractOutcome outcome = ContractOutcome::pending;
+  uint16_t last_used = 0;
+};
+
+
+// Known chargers send the same caps every time so their plan is kept rather than solved again
+class ContractCache {
+public:
+  // FNV-1a over the raw PDOs of every port with caps, the output power planned for and the voltage held, never 0
+  // A held solve can pick a different plan for the same caps so it's kept apart from a free one
+  static uint32_t fingerprint(const SourceCapabilities* const (&caps)[POWER_MUX_PORT_COUNT], uint32_t required_power,
+                              uint32_t hold_voltage);
+
+  // Null if the caps haven't been seen
+  const ContractCacheEntry* find(uint32_t fingerprint);
+
+  // Replaces the least recently used entry if the caps haven't been seen
+  // Only a new plan or outcome dirties the cache, how recently an entry was used isn't worth a flash write
+  void store(uint32_t fingerprint, const ContractPlan& plan);
+  void set_outcome(uint32_t fingerprint, ContractOutcome outcome);
+
+  // Kept in the config store so chargers are still known after a power cycle
+  bool load(ConfigStore& store);
+  bool save(ConfigStore& store);
+  bool dirty() const { return _dirty; };
+
+private:
+  ContractCacheEntry _entries[CONTRACT_CACHE_SIZE];
+  uint16_t _use_counter = 0;
+  bool _dirty = false;
+
+  ContractCacheEntry* entry(uint32_t fingerprint);
 };
 
 
 class PowerMux : public ControllerDelegate {
 public:
-  PowerMux(IController& controller_a, IController& controller_b, PowerSwitch& power_switch_a, PowerSwitch& power_switch_b, DishyPower& dishy_power) :
-      _control_a(controller_a), _control_b(controller_b), _switch_a(power_switch_a), _switch_b(power_switch_b), _dishy_power(dishy_power) {
-    _control_a.set_delegate(this);
-    _control_b.set_delegate(this);
-  };
+  PowerMux(const PowerPortConfig (&ports)[POWER_MUX_PORT_COUNT], DishyPower& dishy_power);
   ~PowerMux() {};
 
   // ControllerDelegate Interface
@@ -38,42 +183,131 @@ public:
 
   // Data events
   void capabilities_received(IController& controller, const SourceCapabilities& caps);
+  void status_received(IController& controller, const SourceStatus& status);
+
+  void set_negotiation_mode(NegotiationMode mode) { _negotiation_mode = mode; };
+
+  // Periodic interface for sharing the load between the ports
+  void tick();
+
+  void set_boost_efficiency(const BoostEfficiencyTable& table) { _boost_efficiency.set_table(table); };
+
+  // Use a fixed load profile
+  void set_load_profile(LoadProfileId id);
+
+  // Start on the lightest profile and switch once the dish has been identified from its load
+  void detect_load_profile();
+
+  void set_admission_mode(AdmissionMode mode) { _admission_mode = mode; };
+
+  // Load the contract cache and keep it saved as it changes
+  void set_config_store(ConfigStore& store);
 
 private:
-  ControllerIndex get_controller(IController& controller);
-  SourceCapability& get_controller_cap(IController& controller);
+  // Find which port a controller belongs to, NO_PORT if it isn't one of ours
+  uint8_t get_port_number(IController& controller);
+  // Decode the selected capability from the ports current caps
+  SourceCapability get_port_cap(const PowerPort& port);
+  SourceCapability get_port_cap(const PowerPort& port, uint8_t index);
 
   // Check if we have enough power now to enable the output
   void check_available_power();
 
-  // Based on selected power modes what is the current available power
+  // Send a request to a port if the plan or its caps have changed
+  void request_port(uint8_t port_number, bool& output_enabled);
+
+  // Solve for the contracts across the ports that have caps from a live source, a plan that worked
+  // for the same caps before is reused
+  ContractPlan solve_contracts(uint32_t hold_voltage);
+
+  // Note how the current plan went against its caps
+  void set_plan_outcome(ContractOutcome outcome);
+
+  // Write the contract cache out once nothing is being negotiated
+  void save_contract_cache();
+
+  // Check if a port in the plan has its contract in place
+  bool is_port_ready(uint8_t port_number);
+
+  // Based on selected power modes what is the current available power from the ports that are ready
   uint32_t total_available_power();
 
+  // The ports ready in the plan cover the output on their own
+  bool can_ride_through();
+
   // Check if the output can be enabled
   void check_if_output_is_ready();
 
+  // Turn on the output once the switches have been enabled
+  void enable_output();
+
   // Should be called when we need to renegotiate power
   void reset(IController& controller);
 
-  // Called to check the number of supplies available
-  uint8_t active_supplies();
+  // Re-plan around the ports that are left after one drops out, keeping the output up if they can carry the load
+  // Only a port that was carrying part of the load makes it a ride through
+  void hand_over(bool was_carrying);
+
+  // Program a ports power switch and keep track of the limit
+  void set_port_current(PowerPort& port, uint32_t current);
+
+  // Split the measured load between the ports in proportion to their contracts, floored at the load profile
+  void share_current();
+
+  // Contract current and power a port is leaned on for, less while its source warns of an overload
+  uint32_t usable_current(const PowerPort& port);
+  uint32_t usable_power(const PowerPort& port);
+
+  void apply_load_profile(LoadProfileId id);
 
-	IController& _control_a;
-	IController& _control_b;
-  PowerSwitch& _switch_a;
-  PowerSwitch& _switch_b;
+  // Pick the profile from the dish load once it's been running through the detect window
+  void check_load_profile();
+
+  // Output power the contracts have to cover before the output can be enabled
+  uint32_t required_power();
+
+  // Shed the output if the measured draw gets close to what the contracts allow
+  void check_load();
+
+  PowerPort _ports[POWER_MUX_PORT_COUNT];
   DishyPower& _dishy_power;
 
-  SourceCapability _port_a_selected_cap;
-  SourceCapability _port_b_selected_cap;
-  SourceCapability _unknown_selected_cap;
+  NegotiationMode _negotiation_mode = NegotiationMode::serial;
+  BoostEfficiency _boost_efficiency;
+  LoadProfileId _load_profile_id = DEFAULT_LOAD_PROFILE;
+  bool _detect_load_profile = false;
+
+  AdmissionMode _admission_mode = AdmissionMode::budget;
+  // Set once the load has been shed, the output then needs the full budget until the sources change
+  bool _load_shed = false;
+
+  // Times the output was enabled on less than the full budget, how many of those were shed and the
+  // highest draw seen as a percent of the contracts
+  uint32_t _marginal_enables = 0;
+  uint32_t _load_sheds = 0;
+  uint32_t _peak_load_percent = 0;
+  ContractPlan _plan;
+
+  ContractCache _contract_cache;
+  ConfigStore* _config_store = 0;
+  uint32_t _plan_fingerprint = 0;
+  bool _plan_cached = false;
+
+  // When the output last came up, a reset soon after goes against the plan
+  uint32_t _output_time = 0;
+
+  // Renegotiations with a live output that kept it up vs ones that had to drop it
+  uint32_t _outages_avoided = 0;
+  uint32_t _renegotiation_outages = 0;
+
+  // Times a port dropped out and the output stayed up on the ones left
+  uint32_t _ride_throughs = 0;
 
-  bool _port_a_requested = false;
-  bool _port_b_requested = false;
+  uint32_t _share_time = 0;
 
-  bool _port_a_accepted = false;
-  bool _port_b_accepted = false;
+  // Used to measure how long it takes to enable the output after PS_RDY
+  uint32_t _ps_rdy_cycles = 0;
 
-  bool _port_a_ps_rdy = false;
-  bool _port_b_ps_rdy = false;
+  // Used to measure how long it takes from the first caps to the output being enabled
+  uint32_t _attach_time = 0;
 };
@@ -19,6 +19,9 @@ public:
   void set_current(uint32_t current);
   void set_enabled(bool enabled);
 
+  // Limit resistance in ohms for a current in milliamps
+  static uint32_t current_to_resistance(uint32_t current);
+
 private:
   Digipot& _digipot;
   uint32_t _gpio_bit = 0;
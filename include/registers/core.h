@@ -24,3 +24,15 @@
 #define STK_CVR REGISTER(0xE000E018)
 #define STK_CAL REGISTER(0xE000E01C)
 
+
+#define SCB_CPUID REGISTER(0xE000ED00)
+#define SCB_ICSR  REGISTER(0xE000ED04)
+#define SCB_VTOR  REGISTER(0xE000ED08)
+#define SCB_AIRCR REGISTER(0xE000ED0C)
+#define SCB_SCR   REGISTER(0xE000ED10)
+#define SCB_CCR   REGISTER(0xE000ED14)
+#define SCB_SHPR2 REGISTER(0xE000ED1C)
+#define SCB_SHPR3 REGISTER(0xE000ED20)
+
+// Write key needed for any AIRCR write
+#define SCB_AIRCR_VECTKEY 0x05FA0000
@@ -0,0 +1,25 @@
+/**
+ * @brief CRC calculation unit registers
+ */
+
+#include "registers/helpers.h"
+
+#pragma once
+
+#define CRC_BASE 0x40023000
+
+#define CRC_DR_OFFSET   0x00000000
+#define CRC_IDR_OFFSET  0x00000004
+#define CRC_CR_OFFSET   0x00000008
+#define CRC_INIT_OFFSET 0x00000010
+#define CRC_POL_OFFSET  0x00000014
+
+
+#define CRC_DR   REGISTER(CRC_BASE + CRC_DR_OFFSET)
+#define CRC_IDR  REGISTER(CRC_BASE + CRC_IDR_OFFSET)
+#define CRC_CR   REGISTER(CRC_BASE + CRC_CR_OFFSET)
+#define CRC_INIT REGISTER(CRC_BASE + CRC_INIT_OFFSET)
+#define CRC_POL  REGISTER(CRC_BASE + CRC_POL_OFFSET)
+
+// Byte wide access to the data register, a byte write only feeds 8 bits into the calculation
+#define CRC_DR_8 (*((volatile uint8_t*)(CRC_BASE + CRC_DR_OFFSET)))
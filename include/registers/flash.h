@@ -53,3 +53,6 @@
 #define FLASH_PCROP2BER REGISTER(FLASH_BASE + FLASH_PCROP2BER_OFFSET)
 #define FLASH_SECR      REGISTER(FLASH_BASE + FLASH_SECR_OFFSET)
 
+// Written to FLASH_KEYR in order to unlock FLASH_CR
+#define FLASH_KEY1 0x45670123
+#define FLASH_KEY2 0xCDEF89AB
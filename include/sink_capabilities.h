@@ -0,0 +1,57 @@
+/**
+ * @brief Sink_Capabilities advertised to the sources
+ * @note Built at compile time from the default load profile and stored in flash in wire order
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "load_profile.h"
+#include "pd_protocol.h"
+#include "units.h"
+
+#define SINK_CAPABILITY_COUNT 5
+
+// Efficiency used to size the advertised currents, the worst point of the boost model
+#define SINK_CAPABILITY_EFFICIENCY_PERMILLE 780
+
+// Largest current a fixed PDO can ask for without a 5A cable
+#define SINK_CAPABILITY_MAX_CURRENT_10MA 300
+
+
+namespace sink_capabilities {
+
+// Fixed voltages the boost runs from, vSafe5V has to come first
+constexpr units::millivolts voltage(uint8_t index) {
+  return index == 0 ? 5000 : index == 1 ? 9000 : index == 2 ? 12000 : index == 3 ? 15000 : 20000;
+}
+
+// Supply current needed to deliver an output power, rounded up to the next 10mA
+constexpr uint32_t current_10ma(units::millivolts voltage, units::milliwatts output_power) {
+  return ((output_power * 1000 + SINK_CAPABILITY_EFFICIENCY_PERMILLE - 1) / SINK_CAPABILITY_EFFICIENCY_PERMILLE * 100 + voltage - 1) / voltage;
+}
+
+// Higher capability is set on the vSafe5V PDO since the dish can't run from it alone
+constexpr uint32_t pdo(uint8_t index, units::milliwatts output_power) {
+  return fixed_pdo::encode(voltage(index) / 50,
+                           current_10ma(voltage(index), output_power) < SINK_CAPABILITY_MAX_CURRENT_10MA ?
+                             current_10ma(voltage(index), output_power) : SINK_CAPABILITY_MAX_CURRENT_10MA) |
+         (index == 0 ? fixed_pdo::SuspendSupported::set(1) : 0);
+}
+
+// Supply power in whole watts, sent as the operational PDP when entering EPR
+constexpr uint32_t operational_pdp(units::milliwatts output_power) {
+  return ((output_power * 1000 + SINK_CAPABILITY_EFFICIENCY_PERMILLE - 1) / SINK_CAPABILITY_EFFICIENCY_PERMILLE + 999) / 1000;
+}
+
+} // namespace sink_capabilities
+
+
+#define SINK_CAPABILITIES_SIZE (SINK_CAPABILITY_COUNT * PD_DATA_OBJECT_SIZE)
+
+// Data objects for the default load profile, the header is added when the message is sent
+extern const uint8_t sink_capability_objects[SINK_CAPABILITIES_SIZE];
+
+// Operational PDP for the default load profile in watts
+extern const uint8_t sink_operational_pdp;
@@ -0,0 +1,29 @@
+/**
+ * @brief Stack high water mark, the free RAM is painted at reset and checked for the deepest overwritten word
+ * @note The static worst case for each entry point comes from tools/stack_report.py
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define STACK_PAINT_WORD 0x5AC3A55C
+
+// Words checked per tick so the scan never holds up the main loop
+#define STACK_SCAN_WORDS 64
+
+
+namespace stack {
+
+
+// Bytes between the end of static data and the top of RAM
+uint32_t size();
+
+// Deepest the stack has been since reset in bytes, scans the whole painted area
+uint32_t high_water_mark();
+
+// Carry on the background scan, reports over RTT when the stack goes deeper than before
+void tick();
+
+
+} // namespace stack
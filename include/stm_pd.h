@@ -3,11 +3,18 @@
  */
 
 #include "circular_buffer.h"
+#include "extended_message.h"
+#include "message_pool.h"
 #include "pd_protocol.h"
 
 #pragma once
 
-#define PD_BUFFER_SIZE 32
+// Queued in place of a block when a hard reset is received or the source detaches
+#define PD_HARD_RESET_BLOCK 0xFE
+#define PD_DETACH_BLOCK 0xFD
+
+// Active CC voltage state while attached to a source advertising 3A, SinkTxOk under PD 3.x
+#define TYPEC_VSTATE_RP_3A 0x3
 
 enum class PDPort : uint8_t {
   unknown = 0,
@@ -15,17 +22,6 @@ enum class PDPort : uint8_t {
   two
 };
 
-struct RXMessage {
-  uint8_t buffer[PD_BUFFER_SIZE] = {0};
-  uint32_t size = 0;
-  bool hard_reset = false;
-};
-
-struct TXMessage {
-  uint8_t buffer[PD_BUFFER_SIZE] = {0};
-  uint32_t size = 0;
-};
-
 class STMPD : public IController {
 public:
   STMPD(PDPort port);
@@ -39,6 +35,9 @@ public:
     _delegate = delegate;
   }
 
+  // Enter EPR when the source offers it so 28V and above contracts can be requested
+  void set_epr_enabled(bool enabled) { _epr_enabled = enabled; };
+
   void send_control_msg(ControlMessageType message_type);
   void send_control_msg(ControlMessageType message_type, uint8_t index);
   void send_hard_reset();
@@ -53,23 +52,71 @@ private:
   PDPort _port;
   uint32_t _base_addr = 0;
   uint8_t _message_id_counter = 0;
+  SpecificationRev _spec_rev = SpecificationRev::two_v_zero;
+  bool _attached = false;
+  bool _caps_pending = false;
   uint32_t _caps_rx_timer = 0;
   uint32_t _hard_reset_timer = 0;
 
-  CircularBuffer<RXMessage, 10> _rx_message_buff;
-  CircularBuffer<TXMessage, 10> _tx_message_buff;
+  // Message pool blocks waiting to be handled or sent
+  CircularBuffer<uint8_t, 10> _rx_message_buff;
+  CircularBuffer<uint8_t, 10> _tx_message_buff;
   bool _tx_dma_inflight = false;
 
-  RXMessage _rx_buff_a;
-  RXMessage _rx_buff_b;
+  // Block the RX DMA is filling
+  uint8_t _rx_block = MESSAGE_POOL_NO_BLOCK;
+
+  // Last PPS request, sent again every PPS_KEEP_ALIVE_MS
+  uint32_t _pps_request = 0;
+  uint32_t _pps_request_time = 0;
+  bool _keep_alive_inflight = false;
+
+  // Source PDO of the last request, EPR requests carry a copy
+  uint32_t _request_pdo = 0;
+
+  bool _epr_enabled = false;
+  bool _epr_capable = false;
+  bool _epr_active = false;
+  bool _epr_entry_sent = false;
+  uint32_t _epr_keep_alive_time = 0;
+
+  // PD 3.x sources are asked for their extended caps once the first contract is in place
+  SourceStatus _source_status;
+  bool _explicit_contract = false;
+  bool _source_info_requested = false;
+
+  // Sink initiated message waiting for SinkTxOk
+  uint8_t _ams_block = MESSAGE_POOL_NO_BLOCK;
+  bool _ams_pending = false;
+
+  ExtendedMessageReceiver _extended_rx;
 
   void send_buffer(const uint8_t* buffer, uint32_t size);
+  void queue_tx(uint8_t block);
+  void record_tx(uint16_t msg_header);
+  void send_request(uint32_t pdo);
+  void send_extended_control(ExtendedControlType control_type);
+  void check_epr_entry();
+  void check_follow_ups();
+  void send_data_msg(DataMessageType message_type, const uint8_t* objects, uint8_t object_count);
+
+  // Collision avoidance for PD 3.x, the source holds Rp at 3A while the sink may start a message sequence
+  bool sink_tx_ok();
+  void start_ams(const uint8_t* buffer, uint32_t size);
+  void release_ams();
+  void cancel_ams();
 
   void handle_rx_dma();
   void handle_hard_reset();
+  void handle_detach();
   void handle_type_c_event();
   void handle_rx_buffer(const uint8_t* buffer, uint32_t size);
   void handle_src_caps_msg(const uint8_t* message, uint32_t len);
+  void handle_extended_msg(const uint8_t* message, uint32_t len);
+  void handle_epr_src_caps_msg(const uint8_t* objects, uint32_t len);
+  void handle_epr_mode_msg(const uint8_t* message, uint32_t len);
+  void handle_alert_msg(const uint8_t* message, uint32_t len);
+  void handle_status_update();
 
   void enable_ints();
   void disable_ints();
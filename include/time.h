@@ -15,3 +15,7 @@ void msleep(uint32_t milli_seconds);
 
 // System time
 uint32_t system_time();
+
+// Free running core cycle count, wraps every ~67 seconds
+// Only useful for measuring short intervals
+uint32_t system_cycles();
@@ -0,0 +1,87 @@
+/**
+ * @brief Fixed point unit helpers
+ * @note The M0+ has no hardware divider so everything here is done with multiplies and shifts
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define RECIPROCAL_TABLE_SIZE 1024
+
+
+namespace units {
+
+
+typedef uint32_t millivolts;
+typedef uint32_t milliamps;
+typedef uint32_t milliwatts;
+typedef uint32_t ohms;
+
+
+// ceil(2^32 / divisor), divisors below 2 are handled by the caller
+constexpr uint32_t reciprocal(uint32_t divisor) {
+  return divisor < 2 ? 0 : (0xFFFFFFFFu / divisor) + 1;
+}
+
+template <uint32_t DIVISOR>
+struct Reciprocal {
+  static_assert(DIVISOR > 1, "Divide by zero or one");
+  static constexpr uint32_t value = reciprocal(DIVISOR);
+};
+
+// Upper 32 bits of a 32x32 multiply built from 16 bit halves so it doesn't pull in __aeabi_lmul
+inline uint32_t mul_hi(uint32_t a, uint32_t b) {
+  uint32_t a_lo = a & 0xFFFF;
+  uint32_t a_hi = a >> 16;
+  uint32_t b_lo = b & 0xFFFF;
+  uint32_t b_hi = b >> 16;
+
+  uint32_t lo_lo = a_lo * b_lo;
+  uint32_t hi_lo = a_hi * b_lo;
+  uint32_t lo_hi = a_lo * b_hi;
+  uint32_t cross = (lo_lo >> 16) + (hi_lo & 0xFFFF) + lo_hi;
+
+  return (a_hi * b_hi) + (hi_lo >> 16) + (cross >> 16);
+}
+
+// Exact dividend / divisor given the reciprocal of the divisor
+// The reciprocal is rounded up so the estimate is at most one too large
+inline uint32_t divide(uint32_t dividend, uint32_t divisor, uint32_t divisor_reciprocal) {
+  if(divisor < 2) {
+    return dividend;
+  }
+
+  uint32_t quotient = mul_hi(dividend, divisor_reciprocal);
+  if(quotient * divisor > dividend) {
+    quotient--;
+  }
+  return quotient;
+}
+
+// Exact dividend / divisor for a runtime divisor below RECIPROCAL_TABLE_SIZE
+uint32_t divide(uint32_t dividend, uint32_t divisor);
+
+// Exact dividend / DIVISOR for a compile time divisor
+template <uint32_t DIVISOR>
+inline uint32_t divide_by(uint32_t dividend) {
+  return divide(dividend, DIVISOR, Reciprocal<DIVISOR>::value);
+}
+
+
+// Conversions to and from the units used on the wire by USB PD
+constexpr millivolts from_50mv(uint32_t voltage_50mv) { return voltage_50mv * 50; }
+constexpr milliamps from_10ma(uint32_t current_10ma) { return current_10ma * 10; }
+constexpr milliwatts from_250mw(uint32_t power_250mw) { return power_250mw * 250; }
+
+inline uint32_t to_50mv(millivolts voltage) { return divide_by<50>(voltage); }
+inline uint32_t to_10ma(milliamps current) { return divide_by<10>(current); }
+inline uint32_t to_250mw(milliwatts power) { return divide_by<250>(power); }
+
+// 50mV * 10mA = 0.5mW
+constexpr milliwatts power(uint32_t voltage_50mv, uint32_t current_10ma) {
+  return (voltage_50mv * current_10ma) >> 1;
+}
+
+
+} // namespace units
@@ -2,6 +2,7 @@
  * @brief Handle the implementation and management of the USB PD protocol
  */
 
+#include "extended_message.h"
 #include "ptn5110.h"
 #include "pd_protocol.h"
 
@@ -22,7 +23,7 @@ enum class PDState {
 
 class USBPDController : public AlertDelegate, public IController {
 public:
-  USBPDController(PTN5110& phy, ControllerDelegate& delegate) : _phy(phy), _delegate(delegate) {
+  USBPDController(PTN5110& phy) : _phy(phy) {
     _phy.set_delegate(this);
   };
   ~USBPDController() {
@@ -39,6 +40,10 @@ public:
   void send_hard_reset();
   void set_vbus_sink(bool enabled);
 
+  void set_delegate(ControllerDelegate* delegate) {
+    _delegate = delegate;
+  }
+
   const SourceCapabilities& caps() { return _source_caps; };
   void request_capability(const SourceCapability& capability);
   void request_capability(const SourceCapability& capability, uint32_t power);
@@ -48,16 +53,32 @@ public:
 
 private:
   PTN5110& _phy;
-  ControllerDelegate& _delegate;
+  ControllerDelegate* _delegate = 0;
   SourceCapabilities _source_caps;
 
   void handle_msg_rx();
   void handle_src_caps_msg(const uint8_t* message, uint32_t len);
+  void handle_extended_msg(const uint8_t* message, uint32_t len);
+  void handle_alert_msg(const uint8_t* message, uint32_t len);
+  void handle_status_update();
   void handle_cc_status();
+  void set_spec_rev(SpecificationRev spec_rev);
 
   void send_request(const uint32_t& request_data);
+  void send_sink_caps();
 
   uint8_t _msg_id_counter = 0;
+  SpecificationRev _spec_rev = SpecificationRev::two_v_zero;
+  ExtendedMessageReceiver _extended_rx;
+
+  // PD 3.x sources are asked for their extended caps once the first contract is in place
+  SourceStatus _source_status;
+  bool _source_info_requested = false;
+
+  // Last PPS request, sent again every PPS_KEEP_ALIVE_MS
+  uint32_t _pps_request = 0;
+  uint32_t _pps_request_time = 0;
+  bool _keep_alive_inflight = false;
   PDState _state = PDState::unknown;
   uint32_t _caps_timer = 0;
   uint32_t _caps_reset_timer = 0;
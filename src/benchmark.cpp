@@ -0,0 +1,127 @@
+#include "benchmark.h"
+
+#ifdef ENABLE_BENCHMARKS
+
+#include "boost_efficiency.h"
+#include "digipot.h"
+#include "pd_protocol.h"
+#include "power_mux.h"
+#include "power_switch.h"
+#include "units.h"
+
+namespace {
+
+
+// Keeps the compiler from throwing away the benchmarked work
+volatile uint32_t bench_sink = 0;
+
+// 20V @ 3.25A fixed supply and a 9-21V @ 60W battery supply
+const uint32_t test_fixed_pdo = fixed_pdo::encode(400, 325);
+const uint32_t test_battery_pdo = battery_pdo::encode(180, 420, 240);
+
+// Source caps message header followed by the fixed PDO
+const uint8_t test_message[] = {0xA1, 0x11, 0x45, 0x41, 0x06, 0x00};
+
+// Fixed PDOs advertised by real chargers, 50mV and 10mA units
+#define CHARGER_PDOS 5
+struct Charger {
+  const char* name;
+  uint8_t count;
+  uint32_t pdos[CHARGER_PDOS];
+};
+
+const Charger charger_corpus[] = {
+  {"Apple 96W", 4, {fixed_pdo::encode(100, 300), fixed_pdo::encode(180, 300), fixed_pdo::encode(300, 300), fixed_pdo::encode(410, 470)}},
+  {"Anker 65W", 4, {fixed_pdo::encode(100, 300), fixed_pdo::encode(180, 300), fixed_pdo::encode(300, 300), fixed_pdo::encode(400, 325)}},
+  {"Lenovo 65W", 4, {fixed_pdo::encode(100, 200), fixed_pdo::encode(180, 200), fixed_pdo::encode(300, 300), fixed_pdo::encode(400, 325)}},
+  {"Generic 45W", 4, {fixed_pdo::encode(100, 300), fixed_pdo::encode(180, 300), fixed_pdo::encode(300, 300), fixed_pdo::encode(400, 225)}},
+  {"Pixel 30W", 3, {fixed_pdo::encode(100, 300), fixed_pdo::encode(180, 300), fixed_pdo::encode(300, 200)}},
+  {"Ugreen 100W", 5, {fixed_pdo::encode(100, 300), fixed_pdo::encode(180, 300), fixed_pdo::encode(240, 300), fixed_pdo::encode(300, 300), fixed_pdo::encode(400, 500)}},
+  {"Dell 130W", 4, {fixed_pdo::encode(100, 300), fixed_pdo::encode(180, 300), fixed_pdo::encode(300, 300), fixed_pdo::encode(400, 650)}},
+};
+
+#define CHARGER_CORPUS_SIZE (sizeof(charger_corpus) / sizeof(charger_corpus[0]))
+
+SourceCapabilities charger_caps(const Charger& charger) {
+  uint8_t objects[CHARGER_PDOS * PD_DATA_OBJECT_SIZE];
+  for(uint8_t index = 0; index < charger.count; index++) {
+    store_le32(objects + index * PD_DATA_OBJECT_SIZE, charger.pdos[index]);
+  }
+  return SourceCapabilities(objects, charger.count);
+}
+
+// Solve every pair of chargers and report what the boost would deliver from the chosen plan
+void benchmark_contract_solver() {
+  BoostEfficiency boost;
+  uint32_t total_cycles = 0;
+
+  for(uint32_t first = 0; first < CHARGER_CORPUS_SIZE; first++) {
+    for(uint32_t second = first; second < CHARGER_CORPUS_SIZE; second++) {
+      SourceCapabilities caps_first = charger_caps(charger_corpus[first]);
+      SourceCapabilities caps_second = charger_caps(charger_corpus[second]);
+      const SourceCapabilities* caps[POWER_MUX_PORT_COUNT] = {0};
+      caps[0] = &caps_first;
+      caps[1 % POWER_MUX_PORT_COUNT] = &caps_second;
+
+      uint32_t start = system_cycles();
+      ContractPlan plan = ContractPlan::solve(caps, 0, boost, load_profile(LoadProfileId::standard).required_power);
+      uint32_t cycles = system_cycles() - start;
+      total_cycles += cycles;
+
+      rtt_printf("BM plan %s + %s: %dmV %dmW in %dmW out %dmA %s %d cyc",
+                 charger_corpus[first].name, charger_corpus[second].name, plan.voltage, plan.power,
+                 plan.output_power, plan.input_current, plan.feasible ? "ok" : "short", cycles);
+    }
+  }
+
+  rtt_printf("BM ContractPlan::solve corpus: %d cyc", total_cycles);
+}
+
+
+} // namespace
+
+
+void run_benchmarks() {
+  rtt_printf("Running benchmarks");
+
+  BENCHMARK("units::divide", bench_sink = units::divide(bench_index * 5000, (bench_index & 0x3FF) | 1));
+  BENCHMARK("__aeabi_uidiv", bench_sink = (bench_index * 5000) / ((bench_index & 0x3FF) | 1));
+
+  BENCHMARK("header decode", {
+    uint16_t msg_header = load_le16(test_message);
+    bench_sink = header::MessageType::get(msg_header) + header::NumDataObjects::get(msg_header) + header::MessageID::get(msg_header);
+  });
+  BENCHMARK("fixed PDO decode", {
+    uint32_t pdo = load_le32(test_message + PD_HEADER_SIZE);
+    bench_sink = fixed_pdo::Voltage50mV::get(pdo) + fixed_pdo::MaxCurrent10mA::get(pdo);
+  });
+
+  BENCHMARK("SourceCapability::max_power fixed", {
+    SourceCapability cap(test_fixed_pdo, 0);
+    bench_sink = cap.max_power();
+  });
+  BENCHMARK("SourceCapability::current battery", {
+    SourceCapability cap(test_battery_pdo, 0);
+    bench_sink = cap.current();
+  });
+
+  SourceCapability fixed_cap(test_fixed_pdo, 0);
+  BENCHMARK("Request::generate_pdo", {
+    Request request(fixed_cap, 30000 + bench_index);
+    bench_sink = request.generate_pdo();
+  });
+
+  BENCHMARK("PowerSwitch::current_to_resistance", bench_sink = PowerSwitch::current_to_resistance(1000 + (bench_index << 4)));
+  BENCHMARK("Digipot::resistance_to_tap", bench_sink = Digipot::resistance_to_tap(7000 + (bench_index << 8)));
+
+  BoostEfficiency boost;
+  BENCHMARK("BoostEfficiency::output_power", bench_sink = boost.output_power(5000 + (bench_index << 6), 20000 + (bench_index << 8)));
+
+  benchmark_contract_solver();
+}
+
+#else
+
+void run_benchmarks() {}
+
+#endif
@@ -0,0 +1,128 @@
+#include "black_box.h"
+
+#include "registers/rcc.h"
+#include "registers/core.h"
+
+#include "interrupts.h"
+#include "rtt.h"
+#include "time.h"
+
+
+namespace {
+
+
+// Left alone by the startup code so it survives a reset
+__attribute__((section(".noinit"))) BlackBoxRecord black_box_record;
+
+const char* const event_names[] = {
+  "boot",
+  "pd rx",
+  "pd tx",
+  "pd hrst",
+  "load mode",
+  "out on",
+  "out off",
+  "port reset",
+  "fault"
+};
+
+static_assert(sizeof(event_names) / sizeof(event_names[0]) == (uint8_t)BlackBoxEvent::fault + 1, "Missing black box event name");
+static_assert((BLACK_BOX_EVENTS & (BLACK_BOX_EVENTS - 1)) == 0, "Black box size has to be a power of two");
+
+
+bool is_valid(const BlackBoxRecord& box) {
+  return box.magic == BLACK_BOX_MAGIC && box.head < BLACK_BOX_EVENTS && box.count <= BLACK_BOX_EVENTS;
+}
+
+const char* event_name(BlackBoxEvent event) {
+  if(event > BlackBoxEvent::fault) {
+    return "?";
+  }
+  return event_names[(uint8_t)event];
+}
+
+void dump(const BlackBoxRecord& box) {
+  rtt_printf("Fault %d pc %x lr %x xpsr %x", box.fault_exception, box.fault_frame[BLACK_BOX_FRAME_PC],
+             box.fault_frame[BLACK_BOX_FRAME_LR], box.fault_frame[BLACK_BOX_FRAME_XPSR]);
+  rtt_printf("r0 %x r1 %x r2 %x r3 %x r12 %x", box.fault_frame[0], box.fault_frame[1], box.fault_frame[2],
+             box.fault_frame[3], box.fault_frame[4]);
+
+  // Oldest first
+  uint32_t index = box.head + BLACK_BOX_EVENTS - box.count;
+  for(uint32_t entry_number = 0; entry_number < box.count; entry_number++, index++) {
+    const BlackBoxEntry& entry = box.entries[index & (BLACK_BOX_EVENTS - 1)];
+    rtt_printf("%dms %s %d %x", entry.time, event_name(entry.event), entry.source, entry.data);
+  }
+}
+
+
+} // namespace
+
+
+namespace black_box {
+
+
+void init() {
+  BlackBoxRecord& box = black_box_record;
+  if(is_valid(box) && box.fault_exception != 0) {
+    rtt_printf("Black box from the last run:");
+    dump(box);
+  }
+
+  box.magic = BLACK_BOX_MAGIC;
+  box.head = 0;
+  box.count = 0;
+  box.fault_exception = 0;
+
+  // Keep why the part came out of reset then clear the flags for next time
+  record(BlackBoxEvent::boot, 0, RCC_CSR >> 16);
+  RCC_CSR |= BIT_23;
+}
+
+void record(BlackBoxEvent event, uint8_t source, uint16_t data) {
+  BlackBoxRecord& box = black_box_record;
+  uint32_t primask = disable_interrupts();
+
+  BlackBoxEntry& entry = box.entries[box.head];
+  entry.time = system_time();
+  entry.event = event;
+  entry.source = source;
+  entry.data = data;
+
+  box.head = (box.head + 1) & (BLACK_BOX_EVENTS - 1);
+  if(box.count < BLACK_BOX_EVENTS) {
+    box.count++;
+  }
+
+  restore_interrupts(primask);
+}
+
+void fault(const uint32_t* frame) {
+  BlackBoxRecord& box = black_box_record;
+
+  // A fault before init leaves nothing worth keeping
+  if(!is_valid(box)) {
+    box.magic = BLACK_BOX_MAGIC;
+    box.head = 0;
+    box.count = 0;
+  }
+
+  uint32_t exception;
+  asm volatile("mrs %0, ipsr" : "=r" (exception));
+  exception &= 0x3F;
+
+  for(uint32_t index = 0; index < BLACK_BOX_FRAME_WORDS; index++) {
+    box.fault_frame[index] = frame[index];
+  }
+  box.fault_exception = exception;
+  record(BlackBoxEvent::fault, 0, exception);
+
+  // Let the writes land then ask for a system reset
+  asm volatile("dsb" ::: "memory");
+  SCB_AIRCR = SCB_AIRCR_VECTKEY | BIT_2;
+  asm volatile("dsb" ::: "memory");
+  while(1);
+}
+
+
+} // namespace black_box
@@ -0,0 +1,86 @@
+#include "boost_efficiency.h"
+
+
+// Estimated, see boost_efficiency.h
+const BoostEfficiencyTable default_boost_efficiency = {
+  {5000, 9000, 12000, 15000, 20000},
+  {25000, 60000, 100000},
+  {
+    {850, 820, 780},  // 5V
+    {900, 890, 870},  // 9V
+    {920, 915, 900},  // 12V
+    {930, 930, 920},  // 15V
+    {945, 950, 945},  // 20V
+  }
+};
+
+
+namespace {
+
+
+// Linear interpolation between two points, the span is in PD units so the divide stays in the reciprocal table
+uint32_t interpolate(uint32_t from, uint32_t to, uint32_t offset, uint32_t span) {
+  if(span == 0) {
+    return from;
+  }
+
+  if(to >= from) {
+    return from + units::divide((to - from) * offset, span);
+  }
+  return from - units::divide((from - to) * offset, span);
+}
+
+
+} // namespace
+
+
+uint32_t BoostEfficiency::efficiency_at(uint8_t voltage_point, units::milliwatts input_power) const {
+  const units::milliwatts* load = _table->load;
+  const uint16_t* permille = _table->permille[voltage_point];
+
+  if(input_power <= load[0]) {
+    return permille[0];
+  }
+
+  for(uint8_t point = 1; point < BOOST_EFFICIENCY_LOAD_POINTS; point++) {
+    if(input_power <= load[point]) {
+      return interpolate(permille[point - 1], permille[point],
+                         units::to_250mw(input_power - load[point - 1]),
+                         units::to_250mw(load[point] - load[point - 1]));
+    }
+  }
+
+  return permille[BOOST_EFFICIENCY_LOAD_POINTS - 1];
+}
+
+uint32_t BoostEfficiency::efficiency(units::millivolts input_voltage, units::milliwatts input_power) const {
+  const units::millivolts* voltage = _table->voltage;
+
+  if(input_voltage >= BOOST_BYPASS_VOLTAGE_MV) {
+    return BOOST_BYPASS_EFFICIENCY_PERMILLE;
+  }
+
+  if(input_voltage <= voltage[0]) {
+    return efficiency_at(0, input_power);
+  }
+
+  for(uint8_t point = 1; point < BOOST_EFFICIENCY_VOLTAGE_POINTS; point++) {
+    if(input_voltage <= voltage[point]) {
+      return interpolate(efficiency_at(point - 1, input_power), efficiency_at(point, input_power),
+                         units::to_50mv(input_voltage - voltage[point - 1]),
+                         units::to_50mv(voltage[point] - voltage[point - 1]));
+    }
+  }
+
+  return efficiency_at(BOOST_EFFICIENCY_VOLTAGE_POINTS - 1, input_power);
+}
+
+units::milliwatts BoostEfficiency::output_power(units::millivolts input_voltage, units::milliwatts input_power) const {
+  return units::divide_by<1000>(input_power * efficiency(input_voltage, input_power));
+}
+
+units::milliwatts BoostEfficiency::input_power(units::millivolts input_voltage, units::milliwatts output_power) const {
+  // Efficiency depends on the input power so start from the output and take one more step, the curve is flat enough
+  uint32_t estimate = units::divide(output_power * 1000, efficiency(input_voltage, output_power));
+  return units::divide(output_power * 1000, efficiency(input_voltage, estimate));
+}
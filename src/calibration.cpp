@@ -0,0 +1,16 @@
+#include "calibration.h"
+
+
+bool load_calibration(ConfigStore& store, Calibration& calibration) {
+  Calibration stored;
+  if(!store.read(ConfigKey::calibration, CALIBRATION_VERSION, &stored, sizeof(stored)) || stored.version != CALIBRATION_VERSION) {
+    return false;
+  }
+
+  calibration = stored;
+  return true;
+}
+
+bool save_calibration(ConfigStore& store, const Calibration& calibration) {
+  return store.write(ConfigKey::calibration, CALIBRATION_VERSION, &calibration, sizeof(calibration));
+}
@@ -0,0 +1,245 @@
+#include "config_store.h"
+
+#include "crc.h"
+#include "registers/helpers.h"
+#include "rtt.h"
+#include "utils.h"
+
+#define CONFIG_ERASED_KEY 0xFF
+
+// First page of the store, placed by the linker script
+extern unsigned __config_start__;
+
+
+namespace {
+
+
+struct PageHeader {
+  uint32_t magic;
+  uint32_t sequence;
+};
+
+// Records from before the version byte was added read back as version 0
+struct RecordHeader {
+  uint8_t key;
+  uint8_t version;
+  uint16_t size;
+  uint32_t crc;
+};
+
+static_assert(sizeof(PageHeader) == CONFIG_PAGE_HEADER_SIZE, "Config page header size mismatch");
+static_assert(sizeof(RecordHeader) == CONFIG_RECORD_HEADER_SIZE, "Config record header size mismatch");
+
+// Values are padded out to whole double words
+uint32_t record_length(uint16_t size) {
+  return CONFIG_RECORD_HEADER_SIZE + ((size + FLASH_PROGRAM_SIZE - 1) & ~(FLASH_PROGRAM_SIZE - 1));
+}
+
+// The CRC covers the key, version and size as well as the value
+uint32_t record_crc(uint8_t key, uint8_t version, uint16_t size, const void* data) {
+  uint8_t key_size[4] = {key, version, (uint8_t)(size & 0xFF), (uint8_t)(size >> 8)};
+  return crc::crc32(data, size, crc::crc32(key_size, sizeof(key_size)));
+}
+
+bool is_erased(uint32_t address, uint32_t size) {
+  for(uint32_t offset = 0; offset < size; offset += 4) {
+    if(REGISTER(address + offset) != 0xFFFFFFFF) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool matches(const uint8_t* a, const uint8_t* b, uint32_t size) {
+  for(uint32_t index = 0; index < size; index++) {
+    if(a[index] != b[index]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint8_t next_page(uint8_t page) {
+  return page + 1 < CONFIG_STORE_PAGES ? page + 1 : 0;
+}
+
+
+} // namespace
+
+
+void ConfigStore::init() {
+  _base = (uint32_t)&__config_start__;
+
+  // The newest page is the one being written
+  uint8_t newest = CONFIG_STORE_PAGES;
+  for(uint8_t page = 0; page < CONFIG_STORE_PAGES; page++) {
+    PageHeader header;
+    cpymem(&header, (const void*)page_address(page), sizeof(header));
+    if(header.magic == CONFIG_STORE_MAGIC && (newest == CONFIG_STORE_PAGES || header.sequence > _sequence)) {
+      newest = page;
+      _sequence = header.sequence;
+    }
+  }
+
+  if(newest == CONFIG_STORE_PAGES) {
+    format();
+    return;
+  }
+
+  // Go round the ring from the oldest page so newer records replace older ones in the index
+  _active_page = newest;
+  uint8_t page = newest;
+  for(uint8_t step = 0; step < CONFIG_STORE_PAGES; step++) {
+    page = next_page(page);
+    PageHeader header;
+    cpymem(&header, (const void*)page_address(page), sizeof(header));
+    if(header.magic == CONFIG_STORE_MAGIC) {
+      _write_offset = scan_page(page);
+    }
+  }
+
+  // Power was lost while the ring moved on, finish recycling the spare page
+  uint8_t spare = next_page(_active_page);
+  if(!is_erased(page_address(spare), FLASH_PAGE_SIZE)) {
+    rtt_printf("Config recycle %d", spare);
+    recycle(spare);
+  }
+
+  rtt_printf("Config page %d seq %d at %d", _active_page, _sequence, _write_offset);
+}
+
+bool ConfigStore::read(ConfigKey key, uint8_t version, void* data, uint16_t size) {
+  uint16_t index = (uint16_t)key;
+  if(index >= (uint16_t)ConfigKey::count || _records[index] == 0) {
+    return false;
+  }
+
+  RecordHeader header;
+  cpymem(&header, (const void*)_records[index], sizeof(header));
+  if(header.version != version || header.size != size) {
+    return false;
+  }
+
+  cpymem(data, (const void*)(_records[index] + CONFIG_RECORD_HEADER_SIZE), size);
+  return true;
+}
+
+bool ConfigStore::write(ConfigKey key, uint8_t version, const void* data, uint16_t size) {
+  uint16_t index = (uint16_t)key;
+  if(index >= (uint16_t)ConfigKey::count || size > CONFIG_MAX_VALUE_SIZE || _base == 0) {
+    return false;
+  }
+
+  if(_records[index] != 0) {
+    RecordHeader header;
+    cpymem(&header, (const void*)_records[index], sizeof(header));
+    if(header.version == version && header.size == size && matches((const uint8_t*)(_records[index] + CONFIG_RECORD_HEADER_SIZE), (const uint8_t*)data, size)) {
+      return true;
+    }
+  }
+
+  if(_write_offset + record_length(size) > FLASH_PAGE_SIZE) {
+    advance();
+  }
+  return append(key, version, data, size);
+}
+
+uint32_t ConfigStore::page_address(uint8_t page) const {
+  return _base + ((uint32_t)page << FLASH_PAGE_SHIFT);
+}
+
+uint8_t ConfigStore::page_of(uint32_t address) const {
+  return (address - _base) >> FLASH_PAGE_SHIFT;
+}
+
+void ConfigStore::format() {
+  rtt_printf("Config format");
+  for(uint8_t page = 0; page < CONFIG_STORE_PAGES; page++) {
+    if(!is_erased(page_address(page), FLASH_PAGE_SIZE)) {
+      flash::erase_page(page_address(page));
+    }
+  }
+
+  _sequence = 0;
+  start_page(0);
+}
+
+bool ConfigStore::start_page(uint8_t page) {
+  PageHeader header = {CONFIG_STORE_MAGIC, ++_sequence};
+  _active_page = page;
+  _write_offset = CONFIG_PAGE_HEADER_SIZE;
+  return flash::program(page_address(page), &header, sizeof(header));
+}
+
+uint32_t ConfigStore::scan_page(uint8_t page) {
+  uint32_t address = page_address(page);
+  uint32_t offset = CONFIG_PAGE_HEADER_SIZE;
+  while(offset + CONFIG_RECORD_HEADER_SIZE <= FLASH_PAGE_SIZE) {
+    RecordHeader header;
+    cpymem(&header, (const void*)(address + offset), sizeof(header));
+    if(header.key == CONFIG_ERASED_KEY) {
+      break;
+    }
+
+    // A size running off the end means the page can't be trusted to take any more
+    uint32_t length = record_length(header.size);
+    if(offset + length > FLASH_PAGE_SIZE) {
+      return FLASH_PAGE_SIZE;
+    }
+
+    // Writes cut short fail the CRC and are stepped over
+    const void* data = (const void*)(address + offset + CONFIG_RECORD_HEADER_SIZE);
+    if(header.key < (uint8_t)ConfigKey::count && header.crc == record_crc(header.key, header.version, header.size, data)) {
+      _records[header.key] = address + offset;
+    }
+    offset += length;
+  }
+  return offset;
+}
+
+void ConfigStore::recycle(uint8_t page) {
+  for(uint16_t index = 0; index < (uint16_t)ConfigKey::count; index++) {
+    if(_records[index] == 0 || page_of(_records[index]) != page) {
+      continue;
+    }
+
+    RecordHeader header;
+    cpymem(&header, (const void*)_records[index], sizeof(header));
+    append((ConfigKey)index, header.version, (const void*)(_records[index] + CONFIG_RECORD_HEADER_SIZE), header.size);
+  }
+
+  if(!is_erased(page_address(page), FLASH_PAGE_SIZE)) {
+    flash::erase_page(page_address(page));
+  }
+}
+
+void ConfigStore::advance() {
+  // The spare page is already erased, the oldest page after it becomes the next spare
+  uint8_t page = next_page(_active_page);
+  start_page(page);
+  recycle(next_page(page));
+}
+
+bool ConfigStore::append(ConfigKey key, uint8_t version, const void* data, uint16_t size) {
+  uint32_t address = page_address(_active_page) + _write_offset;
+  RecordHeader header = {(uint8_t)key, version, size, record_crc((uint8_t)key, version, size, data)};
+
+  // The last part double word is padded with erased bytes
+  uint16_t whole = size & ~(FLASH_PROGRAM_SIZE - 1);
+  uint8_t tail[FLASH_PROGRAM_SIZE];
+  setmem(tail, 0xFF, sizeof(tail));
+  cpymem(tail, (const uint8_t*)data + whole, size - whole);
+
+  // The header goes first so a write that's cut short fails its CRC rather than leaving a hole the scan stops at
+  bool ok = flash::program(address, &header, sizeof(header)) &&
+            flash::program(address + CONFIG_RECORD_HEADER_SIZE, data, whole) &&
+            (whole == size || flash::program(address + CONFIG_RECORD_HEADER_SIZE + whole, tail, sizeof(tail)));
+  _write_offset += record_length(size);
+
+  if(!ok) {
+    rtt_printf("Config write fail %d", (uint16_t)key);
+    return false;
+  }
+  _records[(uint16_t)key] = address;
+  return true;
+}
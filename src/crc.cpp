@@ -0,0 +1,20 @@
+#include "crc.h"
+
+#include "registers/crc.h"
+
+
+uint32_t crc::crc32(const void* data, uint32_t size) {
+  return crc32(data, size, 0xFFFFFFFF);
+}
+
+uint32_t crc::crc32(const void* data, uint32_t size, uint32_t initial) {
+  // Loading INIT and resetting starts the calculation from it
+  CRC_INIT = initial;
+  CRC_CR |= BIT_0;
+
+  const uint8_t* bytes = (const uint8_t*)data;
+  for(uint32_t index = 0; index < size; index++) {
+    CRC_DR_8 = bytes[index];
+  }
+  return CRC_DR;
+}
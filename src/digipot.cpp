@@ -1,6 +1,7 @@
 #include "digipot.h"
 
 #include "rtt.h"
+#include "units.h"
 
 #define MAX_RESISTANCE 100000
 #define MIN_RESISTANCE 325
@@ -18,6 +19,11 @@ void Digipot::init() {
 }
 
 bool Digipot::set_resistance(uint32_t resistance) {
+  // Select the wiper tap
+  return set_tap(resistance_to_tap(resistance));
+}
+
+uint8_t Digipot::resistance_to_tap(uint32_t resistance) {
   if(resistance > MAX_RESISTANCE) {
     resistance = MAX_RESISTANCE;
   }
@@ -25,11 +31,10 @@ bool Digipot::set_resistance(uint32_t resistance) {
   // Figure out which tap we need to select
   uint8_t tap = 0;
   if(resistance > MIN_RESISTANCE) {
-    tap = ((resistance - MIN_RESISTANCE) * WIPER_RES) / MAX_RESISTANCE;
+    tap = units::divide_by<MAX_RESISTANCE>((resistance - MIN_RESISTANCE) * WIPER_RES);
   }
 
-  // Select the wiper tap
-  return set_tap(tap);
+  return tap;
 }
 
 bool Digipot::set_tap(uint8_t tap) {
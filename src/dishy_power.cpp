@@ -1,10 +1,13 @@
 #include "dishy_power.h"
 
+#include "black_box.h"
+#include "boost_efficiency.h"
 #include "registers/adc.h"
 #include "registers/gpio.h"
 #include "registers/rcc.h"
 #include "rtt.h"
 #include "time.h"
+#include "units.h"
 
 /**
  * GPIO Numbers
@@ -17,14 +20,23 @@
  */
 
 #define HIGH_SIDE_COUNTS_2V7 200
-#define HIGH_SIDE_COUNTS_48V 3546
-#define HIGH_SIDE_COUNTS_48V_BUFFER 300
 #define CURRENT_SENSE_COUNT_5W 193
-#define SENSE_VOLTAGE_MEDIAN_1V3 1613
-#define SENSE_VOLTAGE_BUFFER_0V2 248
+#define CURRENT_SENSE_MW_PER_COUNT_Q8 ((5000 << 8) / CURRENT_SENSE_COUNT_5W)
 
+// Thresholds in counts were set on boards running from 3.3V, the factory reference reading was taken at 3.0V
+#define ADC_NOMINAL_VDDA_MV 3300
+#define VREFINT_CAL_VDDA_MV 3000
+#define VREFINT_CAL (*((volatile uint16_t*)0x1FFF75AA))
+#define VREFINT_CHANNEL BIT_13
+#define VREFINT_SAMPLES_SHIFT 4
+
+// 256 samples of a 12 bit reading still fits easily
+#define NO_LOAD_SAMPLES_SHIFT 8
+
+
+void DishyPower::init(Calibration& calibration) {
+  bool calibrated = calibration.version == CALIBRATION_VERSION;
 
-void DishyPower::init() {
   // Setup the GPIO
   RCC_IOPENR    |= BIT_0;
   GPIO_A_ODR    &= ~(BIT_0 | BIT_4 | BIT_5);
@@ -40,15 +52,22 @@ void DishyPower::init() {
   ADC_CR |= BIT_28;
   msleep(1);  // Only 20uS are really needed here
 
-  // Run the ADC cal
-  ADC_CR |= BIT_31;
-  while(ADC_CR & BIT_31);
-  ADC_ISR |= BIT_11;
+  // Run the ADC cal, later boots load the factor it came up with once the ADC is enabled
+  if(!calibrated) {
+    ADC_CR |= BIT_31;
+    while(ADC_CR & BIT_31);
+    ADC_ISR |= BIT_11;
+    calibration.adc_calfact = ADC_CALFACT & 0x7F;
+  }
 
   // Enable the ADC and wait for it to be ready
   ADC_CR |= BIT_0;
   while(!(ADC_ISR & BIT_0));
 
+  if(calibrated) {
+    ADC_CALFACT = calibration.adc_calfact;
+  }
+
   // Setup the sampling config
   if(ADC_CFGR1 & BIT_21) {
     ADC_CFGR1 &= ~(BIT_21);  // Single bit channel sampling sequencing
@@ -72,9 +91,13 @@ void DishyPower::init() {
   ADC_SMPR &= ~(BIT_9 | BIT_10 | BIT_11);
   ADC_SMPR |= (0x7 << BIT0_POS);
 
-  // Capture the current no load counts
-  run_adc_conversion();
-  _current_no_load_counts = _current_counts;
+  if(!calibrated) {
+    measure_calibration(calibration);
+  }
+
+  _gain_q12 = calibration.adc_gain_q12;
+  _current_no_load_counts = calibration.current_no_load_counts;
+  rtt_printf("ADC cal %s - no load %d gain %d", calibrated ? "loaded" : "measured", _current_no_load_counts, _gain_q12);
 }
 
 void DishyPower::tick() {
@@ -82,6 +105,8 @@ void DishyPower::tick() {
   if(!_power_output_enabled) {
     set_load_mode(LoadMode::disabled);
     set_boost(false);
+    _output_power_mw = 0;
+    _peak_output_power_mw = 0;
     return;
   }
 
@@ -98,7 +123,7 @@ void DishyPower::tick() {
 
   // If dishy is connected then we can source power else go back into sense mode
   if(_dishy_connected) {
-    set_load_mode(LoadMode::load_power);
+    set_load_mode(_supply_voltage >= BOOST_BYPASS_VOLTAGE_MV ? LoadMode::load_bypass : LoadMode::load_power);
   } else {
     set_load_mode(LoadMode::sense_voltage);
   }
@@ -106,19 +131,30 @@ void DishyPower::tick() {
 
 void DishyPower::enable_power() {
   rtt_printf("Dishy power enable");
+  black_box::record(BlackBoxEvent::output_on, 0, units::to_50mv(_supply_voltage));
   _power_output_enabled = true;
 }
 
 void DishyPower::disable_power() {
   rtt_printf("Dishy power disable");
+  black_box::record(BlackBoxEvent::output_off);
   _power_output_enabled = false;
 }
 
+uint32_t DishyPower::load_time() const {
+  if(_load_start_time == 0) {
+    return 0;
+  }
+  return system_time() - _load_start_time;
+}
+
 
 void DishyPower::set_load_mode(LoadMode mode) {
   if(_current_mode == mode) {
     return;
   }
+  _load_start_time = 0;
+  black_box::record(BlackBoxEvent::load_mode, 0, (uint16_t)mode);
   switch(mode) {
     case LoadMode::disabled:
       rtt_printf("DishyPower Mode: Disabled");
@@ -132,6 +168,10 @@ void DishyPower::set_load_mode(LoadMode mode) {
       rtt_printf("DishyPower Mode: Load");
       set_load_power_mode();
       break;
+    case LoadMode::load_bypass:
+      rtt_printf("DishyPower Mode: Bypass");
+      set_load_bypass_mode();
+      break;
     default:
       break;
   }
@@ -174,30 +214,100 @@ void DishyPower::set_load_power_mode() {
   set_boost(true);
 
   // Wait for the output to reach regulation
-  while(_high_side_counts < HIGH_SIDE_COUNTS_48V - HIGH_SIDE_COUNTS_48V_BUFFER) {
+  while(_high_side_counts < _profile->output_counts - _profile->output_buffer_counts) {
+    run_adc_conversion();
+  }
+
+  // Enable the load switch
+  GPIO_A_ODR |= BIT_4;
+  _load_start_time = system_time();
+}
+
+void DishyPower::set_load_bypass_mode() {
+  // First disable the sense side switch
+  GPIO_A_ODR &= ~(BIT_5);
+
+  // Wait some time for the switch to disable
+  msleep(1);
+
+  // The supply is already at the output voltage so the boost stays off and it comes through the diode
+  set_boost(false);
+
+  // Wait for the output to come up
+  while(_high_side_counts < _profile->output_counts - _profile->output_buffer_counts) {
     run_adc_conversion();
   }
 
   // Enable the load switch
   GPIO_A_ODR |= BIT_4;
+  _load_start_time = system_time();
 }
 
 void DishyPower::run_adc_conversion() {
   // First up trigger the ADC and run a round of conversions
   ADC_CR |= BIT_2;
   while(!(ADC_ISR & BIT_2));
-  _current_counts = ADC_DR;
+  _current_counts = (ADC_DR * _gain_q12) >> 12;
   ADC_ISR |= BIT_2;
 
   while(!(ADC_ISR & BIT_2));
-  _high_side_counts = ADC_DR;
+  _high_side_counts = (ADC_DR * _gain_q12) >> 12;
   ADC_ISR |= BIT_2;
 
   while(!(ADC_ISR & BIT_2));
-  _low_side_counts = ADC_DR;
+  _low_side_counts = (ADC_DR * _gain_q12) >> 12;
   ADC_ISR |= BIT_2;
 }
 
+void DishyPower::measure_calibration(Calibration& calibration) {
+  // Every channel is read through the same VDDA reference so one correction covers them all
+  uint32_t vrefint = measure_vrefint();
+  uint32_t expected = units::divide_by<ADC_NOMINAL_VDDA_MV / 100>(VREFINT_CAL * (VREFINT_CAL_VDDA_MV / 100));
+  uint16_t gain_q12 = ADC_GAIN_ONE_Q12;
+  if(vrefint >= 4) {
+    // Shifted so the divisor stays inside the reciprocal table
+    gain_q12 = units::divide(expected << 10, vrefint >> 2);
+  }
+  calibration.adc_gain_q12 = gain_q12;
+  _gain_q12 = gain_q12;
+
+  // The load switch is off at boot so anything on the current sense is offset
+  uint32_t total = 0;
+  for(uint32_t sample = 0; sample < (1 << NO_LOAD_SAMPLES_SHIFT); sample++) {
+    run_adc_conversion();
+    total += _current_counts;
+  }
+  calibration.current_no_load_counts = total >> NO_LOAD_SAMPLES_SHIFT;
+  calibration.version = CALIBRATION_VERSION;
+
+  rtt_printf("VREFINT %d expected %d", vrefint, expected);
+}
+
+uint32_t DishyPower::measure_vrefint() {
+  // Switch the sequence over to the internal reference on its own
+  ADC_CCR |= BIT_22;
+  ADC_CHSELR = VREFINT_CHANNEL;
+  while(!(ADC_ISR & BIT_13));  // Wait for the CCRDY flag to set
+  ADC_ISR |= BIT_13;
+  msleep(1);  // Reference start up time
+
+  uint32_t total = 0;
+  for(uint32_t sample = 0; sample < (1 << VREFINT_SAMPLES_SHIFT); sample++) {
+    ADC_CR |= BIT_2;
+    while(!(ADC_ISR & BIT_2));
+    total += ADC_DR;
+    ADC_ISR |= BIT_2;
+  }
+
+  // Back to the three channels
+  ADC_CCR &= ~(BIT_22);
+  ADC_CHSELR = BIT_1 | BIT_2 | BIT_3;
+  while(!(ADC_ISR & BIT_13));  // Wait for the CCRDY flag to set
+  ADC_ISR |= BIT_13;
+
+  return total >> VREFINT_SAMPLES_SHIFT;
+}
+
 void DishyPower::monitor_current() {
   uint32_t current_counts = 0;
   // CYA with regards to subtracting negative unsigned ints
@@ -205,8 +315,19 @@ void DishyPower::monitor_current() {
     current_counts = _current_counts - _current_no_load_counts;
   }
 
+  // Track the load so the input current limits can be shared out to match it
+  uint32_t power = (current_counts * CURRENT_SENSE_MW_PER_COUNT_Q8) >> 8;
+  _output_power_mw = (_output_power_mw * 7 + power) >> 3;
+  if(power > _peak_output_power_mw) {
+    _peak_output_power_mw = power;
+  } else if(system_time() != _peak_decay_time) {
+    // Let the peak fall away over a few seconds
+    _peak_decay_time = system_time();
+    _peak_output_power_mw -= (_peak_output_power_mw - power) >> 12;
+  }
+
   // Check if we are below the threshold of current
-  if(current_counts < CURRENT_SENSE_COUNT_5W) {
+  if(current_counts < units::divide_by<5000>(_profile->disconnect_power * CURRENT_SENSE_COUNT_5W)) {
     _current_below_thresh_counts++;
   } else {
     _current_below_thresh_counts = 0;
@@ -221,8 +342,8 @@ void DishyPower::monitor_current() {
 
 void DishyPower::monitor_sense_voltage() {
   // The voltage should be around 1.3 volts if dishy is connected
-  if(_low_side_counts > (SENSE_VOLTAGE_MEDIAN_1V3 - SENSE_VOLTAGE_BUFFER_0V2) &&
-      _low_side_counts < (SENSE_VOLTAGE_MEDIAN_1V3 + SENSE_VOLTAGE_BUFFER_0V2)) {
+  if(_low_side_counts > (_profile->sense_counts - _profile->sense_window_counts) &&
+      _low_side_counts < (_profile->sense_counts + _profile->sense_window_counts)) {
     _low_side_thresh_counts++;
   } else {
     _low_side_thresh_counts = 0;
@@ -0,0 +1,108 @@
+#include "extended_message.h"
+
+#include "rtt.h"
+#include "time.h"
+#include "utils.h"
+
+
+namespace {
+
+
+ExtendedMessage message_pool[EXTENDED_MESSAGE_POOL_SIZE];
+
+ExtendedMessage* acquire_message() {
+  for(uint8_t index = 0; index < EXTENDED_MESSAGE_POOL_SIZE; index++) {
+    if(!message_pool[index].in_use) {
+      message_pool[index].in_use = true;
+      message_pool[index].size = 0;
+      message_pool[index].received = 0;
+      return &message_pool[index];
+    }
+  }
+  return 0;
+}
+
+
+} // namespace
+
+
+ChunkStatus ExtendedMessageReceiver::receive(const uint8_t* message, uint32_t size) {
+  if(size < PD_HEADER_SIZE + PD_EXTENDED_HEADER_SIZE) {
+    return ChunkStatus::dropped;
+  }
+
+  uint16_t msg_header = load_le16(message);
+  uint16_t ext_header = load_le16(message + PD_HEADER_SIZE);
+  ExtendedMessageType type = (ExtendedMessageType)header::MessageType::get(msg_header);
+  uint8_t chunk_number = extended_header::ChunkNumber::get(ext_header);
+  uint16_t data_size = extended_header::DataSize::get(ext_header);
+
+  // Unchunked messages are never asked for and nothing chunked is sent so there are no chunk requests to answer
+  if(!extended_header::Chunked::get(ext_header) || extended_header::RequestChunk::get(ext_header) || data_size > PD_MAX_EXTENDED_MSG_LEN) {
+    return ChunkStatus::dropped;
+  }
+
+  if(chunk_number == 0) {
+    release();
+    _message = acquire_message();
+    if(!_message) {
+      rtt_printf("Ext msg pool empty");
+      return ChunkStatus::dropped;
+    }
+    _message->type = type;
+    _message->size = data_size;
+    _type = type;
+    _next_chunk = 0;
+  } else if(!_message || chunk_number != _next_chunk || type != _type) {
+    release();
+    return ChunkStatus::dropped;
+  }
+
+  // The last chunk is padded out to a whole data object
+  uint32_t chunk_size = size - (PD_HEADER_SIZE + PD_EXTENDED_HEADER_SIZE);
+  uint32_t remaining = _message->size - _message->received;
+  if(chunk_size > PD_MAX_EXTENDED_MSG_CHUNK_LEN) {
+    chunk_size = PD_MAX_EXTENDED_MSG_CHUNK_LEN;
+  }
+  if(chunk_size > remaining) {
+    chunk_size = remaining;
+  }
+
+  cpymem(_message->data + _message->received, message + PD_HEADER_SIZE + PD_EXTENDED_HEADER_SIZE, chunk_size);
+  _message->received += chunk_size;
+  _next_chunk++;
+
+  if(_message->received >= _message->size) {
+    return ChunkStatus::complete;
+  }
+
+  // A chunk that carries nothing would never finish
+  if(chunk_size == 0) {
+    release();
+    return ChunkStatus::dropped;
+  }
+
+  _chunk_time = system_time();
+  return ChunkStatus::need_chunk;
+}
+
+void ExtendedMessageReceiver::release() {
+  if(_message) {
+    _message->in_use = false;
+    _message = 0;
+  }
+  _next_chunk = 0;
+}
+
+void ExtendedMessageReceiver::check_timeout() {
+  if(_message && _next_chunk > 0 && (system_time() - _chunk_time) > EXTENDED_MESSAGE_CHUNK_TIMEOUT_MS) {
+    rtt_printf("Ext msg chunk %d timeout", _next_chunk);
+    release();
+  }
+}
+
+void encode_chunk_request(uint8_t* buffer, ExtendedMessageType type, SpecificationRev spec_rev, uint8_t message_id, uint8_t chunk_number) {
+  store_le16(buffer, header::encode_extended((uint8_t)type, spec_rev, message_id & 0x07, 1));
+  store_le16(buffer + PD_HEADER_SIZE, extended_header::encode(0, chunk_number, true));
+  store_le16(buffer + PD_HEADER_SIZE + PD_EXTENDED_HEADER_SIZE, 0);
+}
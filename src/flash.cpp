@@ -0,0 +1,92 @@
+#include "flash.h"
+
+#include "registers/flash.h"
+#include "rtt.h"
+#include "utils.h"
+
+// FLASH_SR, busy and the error flags cleared before each operation
+#define FLASH_SR_EOP    BIT_0
+#define FLASH_SR_ERRORS (BIT_1 | BIT_3 | BIT_4 | BIT_5 | BIT_6 | BIT_7 | BIT_8 | BIT_9 | BIT_14 | BIT_15)
+#define FLASH_SR_CFGBSY BIT_18
+
+// FLASH_CR
+#define FLASH_CR_PG   BIT_0
+#define FLASH_CR_PER  BIT_1
+#define FLASH_CR_BKER BIT_13
+#define FLASH_CR_STRT BIT_16
+#define FLASH_CR_LOCK BIT_31
+#define FLASH_CR_PNB_POS 3
+#define FLASH_CR_PNB_MASK 0x3FF
+
+
+namespace {
+
+
+void unlock() {
+  if(FLASH_CR & FLASH_CR_LOCK) {
+    FLASH_KEYR = FLASH_KEY1;
+    FLASH_KEYR = FLASH_KEY2;
+  }
+}
+
+void lock() {
+  FLASH_CR |= FLASH_CR_LOCK;
+}
+
+bool wait_idle() {
+  while(FLASH_SR & FLASH_SR_CFGBSY);
+
+  uint32_t errors = FLASH_SR & FLASH_SR_ERRORS;
+  FLASH_SR = errors | FLASH_SR_EOP;
+  if(errors) {
+    rtt_printf("Flash err %x", errors);
+  }
+  return errors == 0;
+}
+
+
+} // namespace
+
+
+bool flash::erase_page(uint32_t address) {
+  if(address < FLASH_BANK_2_BASE) {
+    return false;
+  }
+
+  unlock();
+  wait_idle();
+
+  uint32_t page = ((address - FLASH_BANK_2_BASE) >> FLASH_PAGE_SHIFT) + FLASH_BANK_2_FIRST_PAGE;
+  FLASH_CR &= ~(FLASH_CR_PNB_MASK << FLASH_CR_PNB_POS);
+  FLASH_CR |= FLASH_CR_PER | FLASH_CR_BKER | ((page & FLASH_CR_PNB_MASK) << FLASH_CR_PNB_POS);
+  FLASH_CR |= FLASH_CR_STRT;
+  bool ok = wait_idle();
+
+  FLASH_CR &= ~(FLASH_CR_PER | FLASH_CR_BKER);
+  lock();
+  return ok;
+}
+
+bool flash::program(uint32_t address, const void* data, uint32_t size) {
+  if(address < FLASH_BANK_2_BASE || (address & (FLASH_PROGRAM_SIZE - 1)) || (size & (FLASH_PROGRAM_SIZE - 1))) {
+    return false;
+  }
+
+  unlock();
+  bool ok = wait_idle();
+  FLASH_CR |= FLASH_CR_PG;
+
+  // The source may not be word aligned so each double word goes through the stack
+  const uint8_t* bytes = (const uint8_t*)data;
+  for(uint32_t offset = 0; ok && offset < size; offset += FLASH_PROGRAM_SIZE) {
+    uint32_t words[2];
+    cpymem(words, bytes + offset, sizeof(words));
+    REGISTER(address + offset) = words[0];
+    REGISTER(address + offset + 4) = words[1];
+    ok = wait_idle();
+  }
+
+  FLASH_CR &= ~FLASH_CR_PG;
+  lock();
+  return ok;
+}
@@ -2,14 +2,17 @@
  * @brief Vector table init
  * */
 
+#include "black_box.h"
+
 // Stack address provided by the linker
 extern int _stack_ptr;
 
 // Weak linkage for default handlers
 #define DEFAULT __attribute__((weak, alias("Default_Handler")))
 
-// Default Handler that loops indefinitely
-extern "C" void Default_Handler() { asm("bkpt 1"); while(1); };
+// Unexpected exceptions leave a black box snapshot and reset
+extern "C" void default_fault(const uint32_t* frame) { black_box::fault(frame); };
+extern "C" __attribute__((naked)) void Default_Handler() { BLACK_BOX_FAULT_ENTRY(default_fault); };
 
 // System Exception Handlers
 void Reset_Handler(void);
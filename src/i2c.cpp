@@ -2,6 +2,41 @@
 
 #include "registers/i2c.h"
 #include "registers/rcc.h"
+#include "registers/syscfg.h"
+
+#define HSI16_CLOCK_HZ 16000000
+#define PCLK_CLOCK_HZ  64000000
+
+// Worst case edge times for the board pull ups
+#define I2C_RISE_TIME_NS 100
+#define I2C_FALL_TIME_NS 10
+
+namespace {
+
+
+// Timing values for each supported kernel clock indexed by I2CSpeed
+const uint32_t hsi16_timings[] = {
+  i2c_timingr(HSI16_CLOCK_HZ, I2CSpeed::standard, I2C_RISE_TIME_NS, I2C_FALL_TIME_NS),
+  i2c_timingr(HSI16_CLOCK_HZ, I2CSpeed::fast, I2C_RISE_TIME_NS, I2C_FALL_TIME_NS),
+  i2c_timingr(HSI16_CLOCK_HZ, I2CSpeed::fast_plus, I2C_RISE_TIME_NS, I2C_FALL_TIME_NS),
+};
+
+const uint32_t pclk_timings[] = {
+  i2c_timingr(PCLK_CLOCK_HZ, I2CSpeed::standard, I2C_RISE_TIME_NS, I2C_FALL_TIME_NS),
+  i2c_timingr(PCLK_CLOCK_HZ, I2CSpeed::fast, I2C_RISE_TIME_NS, I2C_FALL_TIME_NS),
+  i2c_timingr(PCLK_CLOCK_HZ, I2CSpeed::fast_plus, I2C_RISE_TIME_NS, I2C_FALL_TIME_NS),
+};
+
+static_assert(i2c_timingr(HSI16_CLOCK_HZ, I2CSpeed::standard, I2C_RISE_TIME_NS, I2C_FALL_TIME_NS) != 0, "No 100 kHz timing for HSI16");
+static_assert(i2c_timingr(HSI16_CLOCK_HZ, I2CSpeed::fast, I2C_RISE_TIME_NS, I2C_FALL_TIME_NS) != 0, "No 400 kHz timing for HSI16");
+static_assert(i2c_timingr(HSI16_CLOCK_HZ, I2CSpeed::fast_plus, I2C_RISE_TIME_NS, I2C_FALL_TIME_NS) != 0, "No 1 MHz timing for HSI16");
+static_assert(i2c_timingr(PCLK_CLOCK_HZ, I2CSpeed::standard, I2C_RISE_TIME_NS, I2C_FALL_TIME_NS) != 0, "No 100 kHz timing for PCLK");
+static_assert(i2c_timingr(PCLK_CLOCK_HZ, I2CSpeed::fast, I2C_RISE_TIME_NS, I2C_FALL_TIME_NS) != 0, "No 400 kHz timing for PCLK");
+static_assert(i2c_timingr(PCLK_CLOCK_HZ, I2CSpeed::fast_plus, I2C_RISE_TIME_NS, I2C_FALL_TIME_NS) != 0, "No 1 MHz timing for PCLK");
+
+
+} // namespace
+
 
 void I2C::init() {
   // First set the base address for accessing the different registers
@@ -12,47 +47,19 @@ void I2C::init() {
     // Clock Source
     RCC_CCIPR &= ~(BIT_12 | BIT_13);
     RCC_CCIPR |= BIT_13;
+    _kernel_clock_hz = HSI16_CLOCK_HZ;
 
     // Enable the clock
     RCC_APBENR1 |= BIT_21;
-
-    // Setup clock scaling for 100 kHz
-    I2C_1_TIMINGR = 0;
-    I2C_1_TIMINGR |= 0x4;  // SCLL
-    I2C_1_TIMINGR |= 0x2 << 8; // SCLH
-    I2C_1_TIMINGR |= 0x0 << 16; // SDADEL
-    I2C_1_TIMINGR |= 0x2 << 20; // SCLDEL
-    I2C_1_TIMINGR |= 0x0 << 28; // PRESC
-
-    // 7 bit addr mode
-    I2C_1_CR2 &= ~(BIT_11);
-
-    // Enable the peripheral
-    I2C_1_CR1 |= BIT_0;
-
     break;
   case 2:
     _base_addr = I2C_2_BASE;
 
     // Clock source is always the PLL
+    _kernel_clock_hz = PCLK_CLOCK_HZ;
 
     // Enable the clock
     RCC_APBENR1 |= BIT_22;
-
-    // Setup clock scaling for 400 kHz
-    I2C_2_TIMINGR = 0;
-    I2C_2_TIMINGR |= 0x9;  // SCLL
-    I2C_2_TIMINGR |= 0x3 << 8; // SCLH
-    I2C_2_TIMINGR |= 0x2 << 16; // SDADEL
-    I2C_2_TIMINGR |= 0x3 << 20; // SCLDEL
-    I2C_2_TIMINGR |= 0x1 << 28; // PRESC
-
-    // 7 bit addr mode
-    I2C_2_CR2 &= ~(BIT_11);
-
-    // Enable the peripheral
-    I2C_2_CR1 |= BIT_0;
-
     break;
   case 3:
     _base_addr = I2C_3_BASE;
@@ -60,25 +67,59 @@ void I2C::init() {
     // Clock source
     RCC_CCIPR &= ~(BIT_16 | BIT_17);
     RCC_CCIPR |= BIT_17;
+    _kernel_clock_hz = HSI16_CLOCK_HZ;
 
     // Enable the clock
     RCC_APBENR1 |= BIT_30;
+    break;
+  default:
+    return;
+  }
 
-    // Setup clock scaling
-    I2C_3_TIMINGR = 0;
-    I2C_3_TIMINGR |= 0x9;  // SCLL
-    I2C_3_TIMINGR |= 0x3 << 8; // SCLH
-    I2C_3_TIMINGR |= 0x2 << 16; // SDADEL
-    I2C_3_TIMINGR |= 0x3 << 20; // SCLDEL
-    I2C_3_TIMINGR |= 0x1 << 28; // PRESC
+  // Setup clock scaling
+  set_speed(_speed);
 
-    // 7 bit addr mode
-    I2C_3_CR2 &= ~(BIT_11);
+  // 7 bit addr mode
+  REGISTER(_base_addr + I2C_CR2_OFFSET) &= ~(BIT_11);
 
-    // Enable the peripheral
-    I2C_3_CR1 |= BIT_0;
+  // Enable the peripheral
+  REGISTER(_base_addr + I2C_CR1_OFFSET) |= BIT_0;
+}
 
-    break;
+void I2C::set_speed(I2CSpeed speed) {
+  _speed = speed;
+  if(_base_addr == 0) {
+    return;
+  }
+
+  // TIMINGR can only be written while the peripheral is disabled
+  bool enabled = REGISTER(_base_addr + I2C_CR1_OFFSET) & BIT_0;
+  REGISTER(_base_addr + I2C_CR1_OFFSET) &= ~(BIT_0);
+
+  const uint32_t* timings = _kernel_clock_hz == HSI16_CLOCK_HZ ? hsi16_timings : pclk_timings;
+  REGISTER(_base_addr + I2C_TIMINGR_OFFSET) = timings[(uint8_t)speed];
+
+  // Fast mode plus needs the stronger pad drivers
+  uint32_t fmp_bit = 0;
+  switch(_i2c_number) {
+    case 1:
+      fmp_bit = BIT_20;
+      break;
+    case 2:
+      fmp_bit = BIT_21;
+      break;
+    case 3:
+      fmp_bit = BIT_24;
+      break;
+  }
+  if(speed == I2CSpeed::fast_plus) {
+    SYSCFG_CFGR1 |= fmp_bit;
+  } else {
+    SYSCFG_CFGR1 &= ~fmp_bit;
+  }
+
+  if(enabled) {
+    REGISTER(_base_addr + I2C_CR1_OFFSET) |= BIT_0;
   }
 }
 
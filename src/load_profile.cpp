@@ -0,0 +1,58 @@
+#include "load_profile.h"
+
+
+namespace {
+
+
+const LoadProfile load_profiles[(uint8_t)LoadProfileId::count] = {
+  // Standard
+  {
+    "standard",
+    STANDARD_REQUIRED_POWER_MW,
+    60000,
+    3546, 300,    // 48V
+    5000,
+    1613, 248,    // 1.3V +/- 0.2V
+    60000, 0xFFFFFFFF
+  },
+  // Low power
+  {
+    "low_power",
+    LOW_POWER_REQUIRED_POWER_MW,
+    40000,
+    3546, 300,    // 48V
+    3000,
+    1613, 248,    // 1.3V +/- 0.2V
+    0, 60000
+  },
+};
+
+
+} // namespace
+
+
+const LoadProfile& load_profile(LoadProfileId id) {
+  if(id >= LoadProfileId::count) {
+    id = LoadProfileId::standard;
+  }
+  return load_profiles[(uint8_t)id];
+}
+
+LoadProfileId detect_load_profile(units::milliwatts peak_power) {
+  for(uint8_t index = 0; index < (uint8_t)LoadProfileId::count; index++) {
+    if(peak_power >= load_profiles[index].detect_min_power && peak_power < load_profiles[index].detect_max_power) {
+      return (LoadProfileId)index;
+    }
+  }
+  return LoadProfileId::standard;
+}
+
+LoadProfileId lightest_load_profile() {
+  uint8_t lightest = 0;
+  for(uint8_t index = 1; index < (uint8_t)LoadProfileId::count; index++) {
+    if(load_profiles[index].required_power < load_profiles[lightest].required_power) {
+      lightest = index;
+    }
+  }
+  return (LoadProfileId)lightest;
+}
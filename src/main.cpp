@@ -18,6 +18,12 @@
 #include "digipot.h"
 #include "power_switch.h"
 #include "dishy_power.h"
+#include "benchmark.h"
+#include "calibration.h"
+#include "config_store.h"
+#include "black_box.h"
+#include "stack.h"
+#include "message_pool.h"
 
 
 
@@ -33,15 +39,19 @@
  * Digipot Base Addr -> 0b010111A0
  */
 
-I2C digipot_i2c(1);
+I2C digipot_i2c(1, I2CSpeed::fast);
 Digipot digipot_a(digipot_i2c, 0x2E);
 Digipot digipot_b(digipot_i2c, 0x2F);
 PowerSwitch power_switch_a(digipot_a, BIT11_POS);
 PowerSwitch power_switch_b(digipot_b, BIT12_POS);
 DishyPower dishy_power;
+ConfigStore config_store;
 STMPD pd_one(PDPort::one);
 STMPD pd_two(PDPort::two);
-PowerMux power_mux(pd_one, pd_two, power_switch_a, power_switch_b, dishy_power);
+PowerMux power_mux({
+  {pd_one, power_switch_a},
+  {pd_two, power_switch_b}
+}, dishy_power);
 
 
 void PD1_PD2_USB_ISR(void) {
@@ -50,10 +60,13 @@ void PD1_PD2_USB_ISR(void) {
   NVIC_ICPR |= BIT_8;
 }
 
-void HardFault_Handler(void) {
+extern "C" void hard_fault(const uint32_t* frame) {
   status_light::set_color(1, 1, 1);
-  asm("bkpt 1");
-  while(1);
+  black_box::fault(frame);
+}
+
+__attribute__((naked)) void HardFault_Handler(void) {
+  BLACK_BOX_FAULT_ENTRY(hard_fault);
 }
 
 int main() {
@@ -118,18 +131,57 @@ int main() {
   rtt_printf("----------");
   rtt_printf("Booting...");
 
+  // Report how the last run ended before anything new is recorded
+  black_box::init();
+
   status_light::set_color(0, 0, 1);
 
+  // Settings and statistics from the last power cycle
+  config_store.init();
+
+  // Calibration is measured on the first boot and loaded after that
+  Calibration calibration;
+  bool calibrated = load_calibration(config_store, calibration);
+
   // Init all the things
   digipot_i2c.init();
   digipot_a.init();
   digipot_b.init();
   power_switch_a.init();
   power_switch_b.init();
-  dishy_power.init();
+  dishy_power.init(calibration);
+  if(!calibrated) {
+    save_calibration(config_store, calibration);
+  }
   pd_one.init();
   pd_two.init();
 
+#ifdef ENABLE_BENCHMARKS
+  run_benchmarks();
+#endif
+
+  // Known chargers skip the contract solver
+  power_mux.set_config_store(config_store);
+
+  // Negotiate both ports at once to cut the time to power
+  power_mux.set_negotiation_mode(NegotiationMode::parallel);
+
+#ifdef MEASURED_LOAD_ADMISSION
+  // Try the dish on smaller chargers and shed the load if it draws too much
+  power_mux.set_admission_mode(AdmissionMode::measured);
+#endif
+
+#ifdef EPR_SUPPORT
+  // Ask EPR capable chargers for 48V so the output can run with the boost bypassed
+  pd_one.set_epr_enabled(true);
+  pd_two.set_epr_enabled(true);
+#endif
+
+#ifdef LOAD_PROFILE_AUTO_DETECT
+  // Identify the dish from its load instead of using DEFAULT_LOAD_PROFILE
+  power_mux.detect_load_profile();
+#endif
+
   // Enable UCPD Interrupt
   NVIC_ISER |= BIT_8;
 
@@ -138,8 +190,11 @@ int main() {
 
   while(true) {
     dishy_power.tick();
+    power_mux.tick();
     pd_one.tick();
     pd_two.tick();
+    stack::tick();
+    message_pool::tick();
   }
 
   return 0;
@@ -0,0 +1,135 @@
+#include "message_pool.h"
+
+#include "interrupts.h"
+#include "rtt.h"
+
+
+static_assert(MESSAGE_POOL_BLOCKS < MESSAGE_POOL_NO_BLOCK, "Block indices have to fit under MESSAGE_POOL_NO_BLOCK");
+static_assert(MESSAGE_POOL_PORT_QUOTA <= MESSAGE_POOL_BLOCKS, "Port quota is bigger than the pool");
+
+
+namespace {
+
+
+PDMessage messages[MESSAGE_POOL_BLOCKS];
+
+// Stack of free block indices and who holds the rest
+uint8_t free_blocks[MESSAGE_POOL_BLOCKS];
+uint8_t free_count = 0;
+uint8_t block_owner[MESSAGE_POOL_BLOCKS];  // MESSAGE_POOL_NO_BLOCK while free
+uint8_t owner_count[MESSAGE_POOL_OWNERS];
+
+uint8_t pool_high_water = 0;
+uint8_t owner_high_water[MESSAGE_POOL_OWNERS];
+uint32_t failed_acquires = 0;
+uint32_t bad_releases = 0;
+
+// What was last reported by tick
+uint8_t reported_high_water = 0;
+uint32_t reported_failures = 0;
+uint32_t reported_bad_releases = 0;
+bool initialized = false;
+
+
+void init_pool() {
+  for(uint8_t index = 0; index < MESSAGE_POOL_BLOCKS; index++) {
+    free_blocks[index] = MESSAGE_POOL_BLOCKS - 1 - index;
+    block_owner[index] = MESSAGE_POOL_NO_BLOCK;
+  }
+  free_count = MESSAGE_POOL_BLOCKS;
+  initialized = true;
+}
+
+
+} // namespace
+
+
+namespace message_pool {
+
+
+uint8_t acquire(uint8_t owner) {
+  if(owner >= MESSAGE_POOL_OWNERS) {
+    return MESSAGE_POOL_NO_BLOCK;
+  }
+
+  uint32_t primask = disable_interrupts();
+  if(!initialized) {
+    init_pool();
+  }
+
+  if(free_count == 0 || owner_count[owner] >= MESSAGE_POOL_PORT_QUOTA) {
+    failed_acquires++;
+    restore_interrupts(primask);
+    return MESSAGE_POOL_NO_BLOCK;
+  }
+
+  uint8_t block = free_blocks[--free_count];
+  block_owner[block] = owner;
+  owner_count[owner]++;
+
+  uint8_t in_use = MESSAGE_POOL_BLOCKS - free_count;
+  if(in_use > pool_high_water) {
+    pool_high_water = in_use;
+  }
+  if(owner_count[owner] > owner_high_water[owner]) {
+    owner_high_water[owner] = owner_count[owner];
+  }
+
+  restore_interrupts(primask);
+  messages[block].size = 0;
+  return block;
+}
+
+void release(uint8_t block) {
+  if(block >= MESSAGE_POOL_BLOCKS) {
+    return;
+  }
+
+  // A block that's already free going back on the stack would be handed out twice
+  uint32_t primask = disable_interrupts();
+  if(!initialized || block_owner[block] == MESSAGE_POOL_NO_BLOCK) {
+    bad_releases++;
+    restore_interrupts(primask);
+    return;
+  }
+
+  owner_count[block_owner[block]]--;
+  block_owner[block] = MESSAGE_POOL_NO_BLOCK;
+  free_blocks[free_count++] = block;
+  restore_interrupts(primask);
+}
+
+PDMessage& message(uint8_t block) {
+  return messages[block];
+}
+
+uint8_t high_water() {
+  return pool_high_water;
+}
+
+uint8_t high_water(uint8_t owner) {
+  return owner < MESSAGE_POOL_OWNERS ? owner_high_water[owner] : 0;
+}
+
+uint32_t dropped() {
+  return failed_acquires;
+}
+
+void tick() {
+  if(bad_releases != reported_bad_releases) {
+    reported_bad_releases = bad_releases;
+    rtt_printf("Msg pool - %d releases of free blocks", bad_releases);
+  }
+
+  if(pool_high_water == reported_high_water && failed_acquires == reported_failures) {
+    return;
+  }
+
+  reported_high_water = pool_high_water;
+  reported_failures = failed_acquires;
+  rtt_printf("Msg pool high water %d of %d (%d / %d) - %d dropped", pool_high_water, MESSAGE_POOL_BLOCKS,
+             owner_high_water[1], owner_high_water[2], failed_acquires);
+}
+
+
+} // namespace message_pool
@@ -1,79 +1,193 @@
 #include "pd_protocol.h"
 
 #include "rtt.h"
-#include "utils.h"
+#include "units.h"
 
-void vsafe5v_basic_sink_cap(uint8_t* buffer, uint32_t buffer_size, uint32_t* bytes_written) {
-  FixedPowerDataObject vsafe5v_data_obj = {0};
-  if(buffer_size < sizeof(vsafe5v_data_obj)) {
-    *bytes_written = 0;
-    return;
+// Compile time round trip checks of the codec
+static_assert(header::MessageType::get(header::encode(0x1F, SpecificationRev::two_v_zero, 7, 7)) == 0x1F, "Header type");
+static_assert(header::SpecRev::get(header::encode(0x1F, SpecificationRev::two_v_zero, 7, 7)) == 1, "Header spec rev");
+static_assert(header::MessageID::get(header::encode(0x1F, SpecificationRev::two_v_zero, 7, 7)) == 7, "Header ID");
+static_assert(header::NumDataObjects::get(header::encode(0x1F, SpecificationRev::two_v_zero, 7, 7)) == 7, "Header count");
+static_assert(header::encode(0x1F, SpecificationRev::two_v_zero, 7, 7) == 0x7E5F, "Header layout");
+static_assert(header::Extended::get(header::encode_extended(0x01, SpecificationRev::three_v_zero, 0, 7)) == 1, "Extended header bit");
+static_assert(header::negotiate_spec_rev(header::encode(0x01, SpecificationRev::two_v_zero, 0, 1)) == SpecificationRev::two_v_zero, "Older partner revision");
+static_assert(header::negotiate_spec_rev(header::encode(0x01, SpecificationRev::reserved, 0, 1)) == PD_SPEC_REV, "Newer partner revision");
+static_assert(extended_header::encode(260, 9, true) == 0xCD04, "Extended header layout");
+static_assert(fixed_pdo::encode(400, 300) == 0x0006412C, "Fixed PDO layout");
+static_assert(fixed_pdo::Voltage50mV::get(fixed_pdo::encode(1023, 1023)) == 1023, "Fixed PDO voltage");
+static_assert(battery_pdo::encode(180, 420, 240) == 0x5A42D0F0, "Battery PDO layout");
+static_assert(variable_pdo::MinVoltage50mV::get(variable_pdo::encode(180, 420, 300)) == 180, "Variable PDO min voltage");
+static_assert(request_do::encode_fixed(7, 300, 300) == 0x7004B12C, "Fixed RDO layout");
+static_assert(request_do::ObjectPosition::get(request_do::encode_battery(5, 1, 2)) == 5, "Battery RDO position");
+static_assert(pps_apdo::encode(33, 210, 100) == 0xC1A42164, "PPS APDO layout");
+static_assert(request_do::encode_pps(6, 1025, 60) == 0x6008023C, "PPS RDO layout");
+static_assert(request_do::ObjectPosition::get(request_do::encode_fixed(11, 0, 0)) == 11, "EPR RDO position");
+static_assert(epr_mode_do::encode(EPRModeAction::enter, 140) == 0x018C0000, "EPR mode layout");
+
+
+uint32_t SourceCapability::median_voltage_50mv() const {
+  // Battery and variable PDOs share the same voltage layout
+  uint32_t min_voltage = variable_pdo::MinVoltage50mV::get(_pdo);
+  uint32_t max_voltage = variable_pdo::MaxVoltage50mV::get(_pdo);
+  return ((max_voltage - min_voltage) >> 1) + min_voltage;
+}
+
+uint32_t SourceCapability::voltage() const {
+  switch(type()) {
+    case PowerDataObjectType::fixed:
+      return units::from_50mv(fixed_pdo::Voltage50mV::get(_pdo));
+    case PowerDataObjectType::battery:
+    case PowerDataObjectType::variable:
+      return units::from_50mv(median_voltage_50mv());
+    case PowerDataObjectType::augmented:
+      // The boost is most efficient at the top of the range
+      if(!is_pps()) {
+        return 0;
+      }
+      return _voltage_20mv > 0 ? _voltage_20mv * 20 : max_voltage();
+    default:
+      return 0;
   }
+}
 
-  // Setup the struct
-  vsafe5v_data_obj.supply_type = (uint16_t)PowerDataObjectType::fixed;
+uint32_t SourceCapability::min_voltage() const {
+  switch(type()) {
+    case PowerDataObjectType::battery:
+    case PowerDataObjectType::variable:
+      return units::from_50mv(variable_pdo::MinVoltage50mV::get(_pdo));
+    case PowerDataObjectType::augmented:
+      return is_pps() ? pps_apdo::MinVoltage100mV::get(_pdo) * 100 : 0;
+    default:
+      return voltage();
+  }
+}
+
+uint32_t SourceCapability::max_voltage() const {
+  switch(type()) {
+    case PowerDataObjectType::battery:
+    case PowerDataObjectType::variable:
+      return units::from_50mv(variable_pdo::MaxVoltage50mV::get(_pdo));
+    case PowerDataObjectType::augmented:
+      return is_pps() ? pps_apdo::MaxVoltage100mV::get(_pdo) * 100 : 0;
+    default:
+      return voltage();
+  }
+}
 
-  // For a sink fixed PDO this is high capability flag
-  vsafe5v_data_obj.suspend_sup = 1;
-  vsafe5v_data_obj.voltage_50mv = 100;
-  vsafe5v_data_obj.max_current_10ma = 50;
+SourceCapability SourceCapability::programmed(uint32_t voltage) const {
+  SourceCapability capability = *this;
+  if(!is_pps()) {
+    return capability;
+  }
 
-  cpymem(buffer, (uint8_t*)&vsafe5v_data_obj, sizeof(vsafe5v_data_obj));
-  *bytes_written = sizeof(vsafe5v_data_obj);
+  if(voltage < min_voltage()) {
+    voltage = min_voltage();
+  }
+  if(voltage > max_voltage()) {
+    voltage = max_voltage();
+  }
+  capability._voltage_20mv = units::divide_by<20>(voltage);
+  return capability;
 }
 
-SourceCapability::SourceCapability(const PowerDataObject& object, uint8_t index) {
-  _index = index;
-  PowerDataObjectType pdo_type = (PowerDataObjectType)object.supply_type;
+uint32_t SourceCapability::current() const {
+  switch(type()) {
+    case PowerDataObjectType::fixed:
+      return units::from_10ma(fixed_pdo::MaxCurrent10mA::get(_pdo));
+    case PowerDataObjectType::battery:
+      // mW * 1000 / mV with the 50mV and 250mW scales folded in
+      return units::divide(battery_pdo::MaxPower250mW::get(_pdo) * 5000, median_voltage_50mv());
+    case PowerDataObjectType::variable:
+      return units::from_10ma(variable_pdo::MaxCurrent10mA::get(_pdo));
+    case PowerDataObjectType::augmented:
+      return is_pps() ? pps_apdo::MaxCurrent50mA::get(_pdo) * 50 : 0;
+    default:
+      return 0;
+  }
+}
 
-  switch(pdo_type) {
-    case PowerDataObjectType::fixed: {
-      FixedPowerDataObject* fixed_pdo = (FixedPowerDataObject*)(&object);
-      _pdo_type = pdo_type;
-      _voltage = fixed_pdo->voltage_50mv * 50;
-      _current = fixed_pdo->max_current_10ma * 10;
-      _power = (_voltage * fixed_pdo->max_current_10ma * 10) / 1000;
-      break;
-    }
-    case PowerDataObjectType::battery: {
-      BatteryPowerDataObject* batt_pdo = (BatteryPowerDataObject*)(&object);
-      _pdo_type = pdo_type;
-      uint32_t median_voltage = ((batt_pdo->max_voltage_50mv - batt_pdo->min_voltage_50mv) >> 1) + batt_pdo->min_voltage_50mv;
-      _voltage = median_voltage * 50;
-      _power = batt_pdo->max_power_250mw * 250;
-      _current = (_power * 1000) / _voltage;
-      break;
-    }
-    case PowerDataObjectType::variable: {
-      VariablePowerDataObject* var_pdo = (VariablePowerDataObject*)(&object);
-      _pdo_type = pdo_type;
-      uint32_t median_voltage = ((var_pdo->max_voltage_50mv - var_pdo->min_voltage_50mv) >> 1) + var_pdo->min_voltage_50mv;
-      _voltage = median_voltage * 50;
-      _power = var_pdo->max_current_10ma * 10 * median_voltage;
-      _current = (_power * 1000) / _voltage;
-      break;
-    }
+uint32_t SourceCapability::max_power() const {
+  switch(type()) {
+    case PowerDataObjectType::fixed:
+      return units::power(fixed_pdo::Voltage50mV::get(_pdo), fixed_pdo::MaxCurrent10mA::get(_pdo));
+    case PowerDataObjectType::battery:
+      return units::from_250mw(battery_pdo::MaxPower250mW::get(_pdo));
+    case PowerDataObjectType::variable:
+      return units::power(median_voltage_50mv(), variable_pdo::MaxCurrent10mA::get(_pdo));
+    case PowerDataObjectType::augmented:
+      // The current limit holds across the whole range so the power follows the programmed voltage
+      return units::divide_by<1000>(voltage() * current());
     default:
-      break;
+      return 0;
   }
 }
 
 bool SourceCapability::is_battery() const {
-  return _pdo_type == PowerDataObjectType::battery;
+  return type() == PowerDataObjectType::battery;
 }
 
+bool SourceCapability::is_pps() const {
+  return type() == PowerDataObjectType::augmented && pps_apdo::AugmentedType::get(_pdo) == (uint8_t)AugmentedPowerDataObjectType::pps;
+}
+
+
+SourceCapabilities::SourceCapabilities(const uint8_t* objects, uint8_t object_count) {
+  if(object_count > MAX_EPR_CAPABILITIES) {
+    object_count = MAX_EPR_CAPABILITIES;
+  }
 
-SourceCapabilities::SourceCapabilities(const PowerDataObject* objects, uint8_t object_count) {
   for(uint8_t index = 0; index < object_count; index++) {
-    _capabilities[index] = SourceCapability(objects[index], index);
+    _pdos[index] = load_le32(objects + index * PD_DATA_OBJECT_SIZE);
   }
   _capability_count = object_count;
 }
 
+SourceCapability SourceCapabilities::cap(uint8_t index) const {
+  if(index >= _capability_count) {
+    return SourceCapability();
+  }
+  return SourceCapability(_pdos[index], index);
+}
+
+
+bool SourceStatus::overloaded() const {
+  return over_current || over_temperature || current_limited || temperature_status >= TemperatureStatus::warning;
+}
+
+void SourceStatus::update_alert(uint32_t alert) {
+  over_current = over_current || alert_do::OverCurrent::get(alert);
+  over_temperature = over_temperature || alert_do::OverTemperature::get(alert);
+  over_voltage = over_voltage || alert_do::OverVoltage::get(alert);
+}
+
+void SourceStatus::update_status(const uint8_t* status, uint32_t size) {
+  if(size <= SDB_TEMPERATURE_STATUS_OFFSET) {
+    return;
+  }
+
+  temperature = status[SDB_INTERNAL_TEMP_OFFSET];
+  temperature_status = (TemperatureStatus)status_db::TemperatureStatus::get(status[SDB_TEMPERATURE_STATUS_OFFSET]);
+
+  uint8_t event_flags = status[SDB_EVENT_FLAGS_OFFSET];
+  over_current = status_db::OverCurrent::get(event_flags);
+  over_temperature = status_db::OverTemperature::get(event_flags);
+  over_voltage = status_db::OverVoltage::get(event_flags);
+  current_limited = status_db::CurrentLimited::get(event_flags);
+
+  shared_limited = size > SDB_POWER_STATUS_OFFSET && status_db::SharedLimited::get(status[SDB_POWER_STATUS_OFFSET]);
+}
+
+void SourceStatus::update_extended_caps(const uint8_t* caps, uint32_t size) {
+  if(size > SCEDB_SOURCE_PDP_OFFSET) {
+    pdp = caps[SCEDB_SOURCE_PDP_OFFSET];
+  }
+}
+
 
 Request::Request(const SourceCapability& capability, uint32_t power) {
-  _pdo_type = capability.type();
+  _pdo_type = capability.is_pps() ? PowerDataObjectType::augmented : capability.type();
   _voltage = capability.voltage();
+  _max_current = capability.current();
   _power = power;
   _pdo_index = capability.index() + 1;
 }
@@ -84,18 +198,21 @@ uint32_t Request::generate_pdo() {
   switch(_pdo_type) {
     case PowerDataObjectType::fixed:
     case PowerDataObjectType::variable: {
-      FixedRequestPowerDataObject* f_pdo_req = (FixedRequestPowerDataObject*)(&ret_pdo);
-      uint16_t current = (_power / _voltage) / 10;
-      f_pdo_req->max_current_10ma = current;
-      f_pdo_req->op_current_10ma = current;
-      f_pdo_req->object_pos = _pdo_index;
+      // mW * 100 / mV with the 50mV scale folded in
+      uint32_t current = units::divide(_power * 2, units::to_50mv(_voltage));
+      ret_pdo = request_do::encode_fixed(_pdo_index, current, current);
       break;
     }
     case PowerDataObjectType::battery: {
-      BatteryRequestPowerDataObject* b_pdo_req = (BatteryRequestPowerDataObject*)(&ret_pdo);
-      b_pdo_req->max_power_250mw = _power / 250;
-      b_pdo_req->op_power_250mw = b_pdo_req->max_power_250mw;
-      b_pdo_req->object_pos = _pdo_index;
+      uint32_t power = units::to_250mw(_power);
+      ret_pdo = request_do::encode_battery(_pdo_index, power, power);
+      break;
+    }
+    case PowerDataObjectType::augmented: {
+      // Same current in 10mA steps taken down to the 50mA steps of the RDO, never above the APDO limit
+      uint32_t current = units::divide_by<5>(units::divide(_power * 2, units::to_50mv(_voltage)));
+      uint32_t max_current = units::divide_by<50>(_max_current);
+      ret_pdo = request_do::encode_pps(_pdo_index, units::divide_by<20>(_voltage), current < max_current ? current : max_current);
       break;
     }
     default:
@@ -1,11 +1,268 @@
 #include "power_mux.h"
 
+#include "black_box.h"
 #include "output_en.h"
 #include "status_light.h"
-#include "usb_pd_controller.h"
 #include "rtt.h"
+#include "time.h"
+#include "units.h"
+
+
+// 32 bit FNV-1a
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+static_assert(POWER_MUX_PORT_COUNT < 16 && CONTRACT_CACHE_VERSION <= 0xFF, "Contract cache version doesn't fit a byte");
+static_assert(sizeof(ContractCacheEntry) * CONTRACT_CACHE_SIZE <= CONFIG_MAX_VALUE_SIZE, "Contract cache doesn't fit a config record");
+
+
+namespace {
+
+
+uint32_t hash_word(uint32_t hash, uint32_t word) {
+  for(uint8_t byte = 0; byte < 4; byte++) {
+    hash = (hash ^ (word & 0xFF)) * FNV_PRIME;
+    word >>= 8;
+  }
+  return hash;
+}
+
+// Ports are labelled A, B, C... in the logs to match the board
+char port_name(uint8_t port_number) {
+  return 'A' + port_number;
+}
+
+
+} // namespace
+
+
+void PowerPort::reset() {
+  selected_index = NO_CAPABILITY;
+  requested = false;
+  accepted = false;
+  ps_rdy = false;
+  caps_valid = false;
+  renegotiate = false;
+  in_place = false;
+  contract = SourceCapability();
+  current_limit = 0;
+  status = SourceStatus();
+}
+
+
+ContractPlan::ContractPlan() {
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    index[port_number] = NO_CAPABILITY;
+  }
+}
+
+bool ContractPlan::is_better_than(const ContractPlan& other) const {
+  // Anything that meets the power budget beats anything that doesn't
+  if(feasible != other.feasible) {
+    return feasible;
+  }
+
+  // Without a workable plan get as much power to the output as possible
+  if(!feasible) {
+    return output_power > other.output_power;
+  }
+
+  // Least current from the supplies to carry the load, a higher voltage and a more efficient boost both help
+  if(input_current != other.input_current) {
+    return input_current < other.input_current;
+  }
+
+  // Then take the most headroom
+  return output_power > other.output_power;
+}
+
+bool ContractPlan::same_as(const ContractPlan& other) const {
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    if(index[port_number] != other.index[port_number]) {
+      return false;
+    }
+  }
+  return voltage == other.voltage && power == other.power && output_power == other.output_power &&
+         input_current == other.input_current && feasible == other.feasible;
+}
+
+void ContractPlan::evaluate(const BoostEfficiency& boost, uint32_t required_power) {
+  output_power = boost.output_power(voltage, power);
+  feasible = output_power >= required_power;
+
+  // 50mV * 10mA = 0.5mW so twice the power over the voltage in 50mV gives 10mA
+  uint32_t voltage_50mv = units::to_50mv(voltage);
+  uint32_t required_input = boost.input_power(voltage, required_power);
+  input_current = voltage_50mv > 0 ? units::from_10ma(units::divide(required_input * 2, voltage_50mv)) : 0xFFFFFFFF;
+}
+
+ContractPlan ContractPlan::solve(const SourceCapabilities* const (&caps)[POWER_MUX_PORT_COUNT], uint32_t hold_voltage,
+                                 const BoostEfficiency& boost, uint32_t required_power) {
+  ContractPlan best;
+  ContractPlan held;
+
+  // Every capability on offer sets up a candidate plan
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    if(!caps[port_number]) {
+      continue;
+    }
+
+    for(uint8_t index = 0; index < caps[port_number]->count(); index++) {
+      const auto cap = caps[port_number]->cap(index);
+
+      ContractPlan candidate;
+      if(cap.type() == PowerDataObjectType::fixed || cap.is_pps()) {
+        // Supplies can only be paralleled when they all run at the same voltage
+        candidate = at_voltage(caps, cap.voltage());
+      } else {
+        candidate.index[port_number] = index;
+        candidate.voltage = cap.voltage();
+        candidate.power = cap.max_power();
+      }
+      candidate.evaluate(boost, required_power);
+
+      if(candidate.is_better_than(best)) {
+        best = candidate;
+      }
+      if(candidate.voltage == hold_voltage && candidate.is_better_than(held)) {
+        held = candidate;
+      }
+    }
+  }
+
+  // Staying at the live voltage beats a better plan that would mean dropping the output
+  return held.feasible ? held : best;
+}
+
+ContractPlan ContractPlan::at_voltage(const SourceCapabilities* const (&caps)[POWER_MUX_PORT_COUNT], uint32_t voltage) {
+  ContractPlan plan;
+  plan.voltage = voltage;
+
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    if(!caps[port_number]) {
+      continue;
+    }
+
+    // Adding a port only ever adds power so take the biggest supply each one has at this voltage,
+    // a PPS supply can join any plan inside its range
+    uint32_t port_power = 0;
+    for(uint8_t index = 0; index < caps[port_number]->count(); index++) {
+      const auto cap = caps[port_number]->cap(index);
+      uint32_t cap_power = 0;
+      if(cap.type() == PowerDataObjectType::fixed && cap.voltage() == voltage) {
+        cap_power = cap.max_power();
+      } else if(cap.is_pps() && voltage >= cap.min_voltage() && voltage <= cap.max_voltage()) {
+        cap_power = cap.programmed(voltage).max_power();
+      }
+
+      if(cap_power > port_power) {
+        plan.index[port_number] = index;
+        port_power = cap_power;
+      }
+    }
+    plan.power += port_power;
+  }
+
+  return plan;
+}
+
+
+uint32_t ContractCache::fingerprint(const SourceCapabilities* const (&caps)[POWER_MUX_PORT_COUNT], uint32_t required_power,
+                                   uint32_t hold_voltage) {
+  uint32_t hash = FNV_OFFSET_BASIS;
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    // Ports without caps still count so the same charger on another port is another set
+    uint8_t count = caps[port_number] ? caps[port_number]->count() : 0;
+    hash = hash_word(hash, count);
+    for(uint8_t index = 0; index < count; index++) {
+      hash = hash_word(hash, caps[port_number]->pdo(index));
+    }
+  }
+  hash = hash_word(hash, required_power);
+  hash = hash_word(hash, hold_voltage);
+
+  // 0 marks an empty entry
+  return hash != 0 ? hash : 1;
+}
+
+const ContractCacheEntry* ContractCache::find(uint32_t fingerprint) {
+  ContractCacheEntry* known = entry(fingerprint);
+  if(known) {
+    known->last_used = ++_use_counter;
+  }
+  return known;
+}
+
+void ContractCache::store(uint32_t fingerprint, const ContractPlan& plan) {
+  ContractCacheEntry* slot = entry(fingerprint);
+  if(slot) {
+    // find has already marked it used
+    if(slot->plan.same_as(plan) && slot->outcome == ContractOutcome::pending) {
+      return;
+    }
+  } else {
+    // Take an empty entry if there is one, otherwise the one used longest ago
+    slot = &_entries[0];
+    for(uint8_t index = 1; index < CONTRACT_CACHE_SIZE && slot->fingerprint != 0; index++) {
+      ContractCacheEntry& candidate = _entries[index];
+      if(candidate.fingerprint == 0 || (uint16_t)(_use_counter - candidate.last_used) > (uint16_t)(_use_counter - slot->last_used)) {
+        slot = &candidate;
+      }
+    }
+    slot->last_used = ++_use_counter;
+  }
+
+  slot->fingerprint = fingerprint;
+  slot->plan = plan;
+  slot->outcome = ContractOutcome::pending;
+  _dirty = true;
+}
+
+void ContractCache::set_outcome(uint32_t fingerprint, ContractOutcome outcome) {
+  ContractCacheEntry* known = entry(fingerprint);
+  if(known && known->outcome != outcome) {
+    known->outcome = outcome;
+    _dirty = true;
+  }
+}
+
+bool ContractCache::load(ConfigStore& store) {
+  if(!store.read(ConfigKey::contract_cache, CONTRACT_CACHE_VERSION, _entries, sizeof(_entries))) {
+    return false;
+  }
+
+  // Carry on counting from the most recently used entry
+  for(uint8_t index = 0; index < CONTRACT_CACHE_SIZE; index++) {
+    if(_entries[index].fingerprint != 0 && (uint16_t)(_entries[index].last_used - _use_counter) < 0x8000) {
+      _use_counter = _entries[index].last_used;
+    }
+  }
+  return true;
+}
+
+bool ContractCache::save(ConfigStore& store) {
+  _dirty = false;
+  return store.write(ConfigKey::contract_cache, CONTRACT_CACHE_VERSION, _entries, sizeof(_entries));
+}
+
+ContractCacheEntry* ContractCache::entry(uint32_t fingerprint) {
+  for(uint8_t index = 0; index < CONTRACT_CACHE_SIZE; index++) {
+    if(_entries[index].fingerprint == fingerprint) {
+      return &_entries[index];
+    }
+  }
+  return 0;
+}
+
+
+PowerMux::PowerMux(const PowerPortConfig (&ports)[POWER_MUX_PORT_COUNT], DishyPower& dishy_power) : _dishy_power(dishy_power) {
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    _ports[port_number].controller = &ports[port_number].controller;
+    _ports[port_number].power_switch = &ports[port_number].power_switch;
+    _ports[port_number].controller->set_delegate(this);
+  }
+}
 
-#define MAX_SUPPLY_CAPABILITIES 8
 
 // Control Events
 void PowerMux::go_to_min_received(IController& controller) {
@@ -14,48 +271,48 @@ void PowerMux::go_to_min_received(IController& controller) {
 }
 
 void PowerMux::accept_received(IController& controller) {
-  switch(get_controller(controller)) {
-    case ControllerIndex::a:
-      _port_a_accepted = true;
-      break;
-    case ControllerIndex::b:
-      _port_b_accepted = true;
-      break;
-    default:
-      break;
+  uint8_t port_number = get_port_number(controller);
+  if(port_number == NO_PORT) {
+    return;
   }
+
+  _ports[port_number].accepted = true;
 }
 
 void PowerMux::reject_received(IController& controller) {
-  switch(get_controller(controller)) {
-     case ControllerIndex::a:
-      _port_a_accepted = false;
-      _port_a_requested = false;
-      _port_a_selected_cap = SourceCapability();
-      break;
-    case ControllerIndex::b:
-      _port_b_accepted = false;
-      _port_b_requested = false;
-      _port_b_selected_cap = SourceCapability();
-      break;
-    default:
-      break;
+  uint8_t port_number = get_port_number(controller);
+  if(port_number == NO_PORT) {
+    return;
+  }
+
+  if(_plan.uses(port_number)) {
+    set_plan_outcome(ContractOutcome::rejected);
   }
+
+  PowerPort& port = _ports[port_number];
+  port.accepted = false;
+  port.requested = false;
+  port.in_place = false;
+  port.selected_index = NO_CAPABILITY;
+
+  // A rejected in place renegotiation leaves the output without a plan
+  check_if_output_is_ready();
 }
 
 void PowerMux::ps_ready_received(IController& controller) {
-  switch(get_controller(controller)) {
-     case ControllerIndex::a:
-      _port_a_ps_rdy = true;
-      _port_a_requested = false;
-      break;
-    case ControllerIndex::b:
-      _port_b_ps_rdy = true;
-      _port_b_requested = false;
-      break;
-    default:
-      break;
+  uint8_t port_number = get_port_number(controller);
+  if(port_number != NO_PORT) {
+    PowerPort& port = _ports[port_number];
+    port.ps_rdy = true;
+    port.requested = false;
+    port.contract = get_port_cap(port);
+    if(port.in_place) {
+      // The new contract is in place so the limit can move up to it
+      port.in_place = false;
+      set_port_current(port, port.contract.current());
+    }
   }
+  _ps_rdy_cycles = system_cycles();
 
   // Check power caps
   check_available_power();
@@ -66,29 +323,14 @@ void PowerMux::ps_ready_received(IController& controller) {
 
 void PowerMux::reset_received(IController& controller) {
   status_light::set_color(1, 0, 0);
+  if(_dishy_power.is_power_enabled() && system_time() - _output_time < CONTRACT_CACHE_RESET_WINDOW_MS) {
+    set_plan_outcome(ContractOutcome::reset);
+  }
   reset(controller);
 }
 
 void PowerMux::controller_disconnected(IController& controller) {
-  _dishy_power.disable_power();
-  switch(get_controller(controller)) {
-    case ControllerIndex::a:
-      _port_a_accepted = false;
-      _port_a_ps_rdy = false;
-      _port_a_selected_cap = SourceCapability();
-      _switch_a.set_enabled(false);
-      break;
-    case ControllerIndex::b:
-      _port_b_accepted = false;
-      _port_b_ps_rdy = false;
-      _port_b_selected_cap = SourceCapability();
-      _switch_b.set_enabled(false);
-      break;
-    default:
-      break;
-  }
-
-  check_if_output_is_ready();
+  reset(controller);
   rtt_printf("Cntrl discon");
 }
 
@@ -96,198 +338,491 @@ void PowerMux::controller_disconnected(IController& controller) {
 // Data events
 void PowerMux::capabilities_received(IController& controller, const SourceCapabilities& caps) {
   rtt_printf("Caps RX");
-  // Some sources with multiple ports will renegotiate after another port is connected so check to
-  // make sure we still have enough poweR
-  if((_port_a_accepted || _port_a_ps_rdy) && get_controller(controller) == ControllerIndex::a) {
-    rtt_printf("Src reset");
-    controller_disconnected(controller);
-  } else if((_port_b_accepted || _port_b_ps_rdy) && get_controller(controller) == ControllerIndex::b) {
-    rtt_printf("Src reset");
-    controller_disconnected(controller);
+  if(_attach_time == 0 && !_dishy_power.is_power_enabled()) {
+    _attach_time = system_time();
+  }
+
+  // New sources get another chance at measured admission
+  _load_shed = false;
+
+  uint8_t port_number = get_port_number(controller);
+  if(port_number != NO_PORT) {
+    PowerPort& port = _ports[port_number];
+    port.caps_valid = true;
+
+    // Some sources with multiple ports will renegotiate after another port is connected. The old
+    // contract stays in place until the new one is ready so the output only drops if it has to
+    if(port.requested || port.accepted || port.ps_rdy || port.in_place) {
+      rtt_printf("Src reneg %c", port_name(port_number));
+      port.renegotiate = true;
+      port.requested = false;  // New caps cancel any request in flight
+      port.accepted = false;
+    }
   }
 
   // Check the capabilities
   check_available_power();
 }
 
-ControllerIndex PowerMux::get_controller(IController& controller) {
-  if(&_control_a == &controller) {
-    return ControllerIndex::a;
+void PowerMux::status_received(IController& controller, const SourceStatus& status) {
+  uint8_t port_number = get_port_number(controller);
+  if(port_number == NO_PORT) {
+    return;
+  }
+
+  PowerPort& port = _ports[port_number];
+  bool was_overloaded = port.status.overloaded();
+  port.status = status;
+  if(status.overloaded() == was_overloaded) {
+    return;
   }
 
-  if(&_control_b == &controller) {
-    return ControllerIndex::b;
+  if(status.overloaded()) {
+    rtt_printf("Port %c overload warn - ocp %d otp %d temp %d", port_name(port_number), status.over_current,
+               status.over_temperature, (uint8_t)status.temperature_status);
+  } else {
+    rtt_printf("Port %c overload clear", port_name(port_number));
   }
 
-  return ControllerIndex::unknown;
+  // Move the load across to the other ports now rather than waiting for the source to trip, and drop
+  // the output if what's left can't carry it
+  if(_dishy_power.is_power_enabled()) {
+    share_current();
+    check_load();
+    check_if_output_is_ready();
+  }
 }
 
-SourceCapability& PowerMux::get_controller_cap(IController& controller) {
-  switch(get_controller(controller)) {
-    case ControllerIndex::a:
-      return _port_a_selected_cap;
-    case ControllerIndex::b:
-      return _port_b_selected_cap;
-    default:
-      break;
+uint8_t PowerMux::get_port_number(IController& controller) {
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    if(_ports[port_number].controller == &controller) {
+      return port_number;
+    }
   }
-  return _unknown_selected_cap;
+
+  return NO_PORT;
 }
 
-void PowerMux::check_available_power() {
-  // Check the available capabilities for each supply
-  uint32_t port_a_max_powers[MAX_SUPPLY_CAPABILITIES] = {0};
-  uint32_t port_b_max_powers[MAX_SUPPLY_CAPABILITIES] = {0};
-  uint8_t port_a_cap_count = _control_a.caps().count();
-  uint8_t port_b_cap_count = _control_b.caps().count();
+SourceCapability PowerMux::get_port_cap(const PowerPort& port) {
+  return get_port_cap(port, port.selected_index);
+}
 
-  for(uint8_t index = 0; index < port_a_cap_count; index++) {
-    port_a_max_powers[index] = _control_a.caps().caps()[index].max_power();
-    const auto& cap  = _control_a.caps().caps()[index];
-    rtt_printf("Port A - %d - %dmV - %dmA", cap.index(), cap.voltage(), cap.current());
+SourceCapability PowerMux::get_port_cap(const PowerPort& port, uint8_t index) {
+  // PPS supplies are programmed to the plan voltage so they line up with the other ports
+  return port.controller->caps().cap(index).programmed(_plan.voltage);
+}
+
+void PowerMux::check_available_power() {
+  // Pick the contracts for every port at once so they end up at the same voltage
+  bool output_enabled = _dishy_power.is_power_enabled();
+  _plan = solve_contracts(output_enabled ? _plan.voltage : 0);
+
+  // Dump the available capabilities for each supply, known chargers have been seen already
+  if(_plan_cached) {
+    rtt_printf("Known caps %x", _plan_fingerprint);
+  } else {
+    for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+      const SourceCapabilities& caps = _ports[port_number].controller->caps();
+      for(uint8_t index = 0; index < caps.count(); index++) {
+        const auto cap = caps.cap(index);
+        rtt_printf("Port %c - %d - %dmV - %dmA", port_name(port_number), cap.index(), cap.voltage(), cap.current());
+      }
+    }
+  }
+  rtt_printf("Plan - %dmV %dmW in %dmW out", _plan.voltage, _plan.power, _plan.output_power);
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    if(_plan.uses(port_number)) {
+      rtt_printf("Plan %c - Cap %d", port_name(port_number), _plan.index[port_number]);
+    }
   }
 
-  for(uint8_t index = 0; index < port_b_cap_count; index++) {
-    port_b_max_powers[index] = _control_b.caps().caps()[index].max_power();
-    const auto& cap = _control_b.caps().caps()[index];
-    rtt_printf("Port B - %d - %dmV - %dmA", cap.index(), cap.voltage(), cap.current());
+  // In serial mode requests go out one port at a time so that the caps on the later ports
+  // can be updated after the earlier ones have negotiated their contracts. In parallel mode
+  // every port is requested at once and a port is only renegotiated if its caps change.
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    request_port(port_number, output_enabled);
+
+    // Inflight check
+    if(_negotiation_mode == NegotiationMode::serial && _ports[port_number].requested) {
+      return;
+    }
   }
+}
 
-  // General strategy here is to negotiate the highest power available on port A
-  // then negotiate the highest power available on port B. This needs to be done
-  // in series so that the caps on port B can be updated after port A has
-  // negotiated its contract.
+void PowerMux::request_port(uint8_t port_number, bool& output_enabled) {
+  PowerPort& port = _ports[port_number];
+  const SourceCapabilities& caps = port.controller->caps();
 
-  uint8_t port_a_max_power_cap = 0;
-  uint32_t port_a_max_power = 0;
-  uint8_t port_b_max_power_cap = 0;
-  uint32_t port_b_max_power = 0;
+  // Ports not in the plan are parked on vSafe5V which is always the first PDO
+  uint8_t target = _plan.uses(port_number) ? _plan.index[port_number] : 0;
+  if(port.requested || !port.caps_valid || caps.count() == 0) {
+    return;
+  }
 
-  // Port A Inflight check
-  if(_port_a_requested) {
+  // A PPS supply staying on the same APDO still needs a new request when the plan voltage moves
+  const auto cap = get_port_cap(port, target);
+  if(port.ps_rdy && !port.renegotiate && port.selected_index == target && port.contract.voltage() == cap.voltage()) {
     return;
   }
 
-  // Request the highest power on port A
-  if(!_port_a_ps_rdy && _control_a.caps().count() > 0) {
-    for(uint8_t index = 0; index < port_a_cap_count; index++) {
-      if(port_a_max_powers[index] >= port_a_max_power) {
-        port_a_max_power = port_a_max_powers[index];
-        port_a_max_power_cap = index;
+  bool live = port.ps_rdy || port.in_place;
+
+  // The output can ride through if the supply stays at the same voltage and the new plan still covers the load
+  port.in_place = live && output_enabled && _plan.feasible &&
+                  _plan.index[port_number] == target && cap.voltage() == port.contract.voltage();
+  if(port.in_place) {
+    _outages_avoided++;
+    rtt_printf("Port %c reneg in place - avoided %d dropped %d", port_name(port_number), _outages_avoided, _renegotiation_outages);
+
+    // Don't draw more than either contract allows until the new one is in place
+    set_port_current(port, cap.current() < port.contract.current() ? cap.current() : port.contract.current());
+  } else {
+    // Don't leave the output up while the supply changes voltage, unless the port is being parked
+    // and the ports left in the plan carry the load on their own
+    if(live) {
+      port.power_switch->set_enabled(false);
+      if(output_enabled && (_plan.uses(port_number) || !can_ride_through())) {
+        _renegotiation_outages++;
+        output_enabled = false;
+        _dishy_power.disable_power();
+      } else if(output_enabled) {
+        _outages_avoided++;
+        rtt_printf("Port %c parked under load - avoided %d dropped %d", port_name(port_number), _outages_avoided, _renegotiation_outages);
       }
     }
 
-    _port_a_selected_cap = _control_a.caps().caps()[port_a_max_power_cap];
-    _port_a_accepted = false;
-    _port_a_ps_rdy = false;
-    _port_a_requested = true;
-    rtt_printf("Port A Request - Cap %d -> %dmV @ %dmA", _port_a_selected_cap.index(), _port_a_selected_cap.voltage(), _port_a_selected_cap.current());
-    _control_a.request_capability(_port_a_selected_cap);
-    return;
+    // Stage the current limit now so PS_RDY only has to flip the switch on
+    set_port_current(port, cap.current());
+  }
+
+  port.selected_index = target;
+  port.accepted = false;
+  port.ps_rdy = false;
+  port.renegotiate = false;
+  port.requested = true;
+  rtt_printf("Port %c Request - Cap %d -> %dmV @ %dmA", port_name(port_number), cap.index(), cap.voltage(), cap.current());
+  port.controller->request_capability(cap);
+}
+
+ContractPlan PowerMux::solve_contracts(uint32_t hold_voltage) {
+  const SourceCapabilities* caps[POWER_MUX_PORT_COUNT];
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    caps[port_number] = _ports[port_number].caps_valid ? &_ports[port_number].controller->caps() : 0;
+  }
+
+  // Only a plan that brought the output up is reused, and a live output has to be able to stay at its voltage
+  _plan_fingerprint = ContractCache::fingerprint(caps, required_power(), hold_voltage);
+  const ContractCacheEntry* known = _contract_cache.find(_plan_fingerprint);
+  _plan_cached = known && known->outcome == ContractOutcome::accepted && (hold_voltage == 0 || known->plan.voltage == hold_voltage);
+  if(_plan_cached) {
+    return known->plan;
   }
+  if(known && known->outcome != ContractOutcome::pending) {
+    rtt_printf("Known caps %x - last plan %s", _plan_fingerprint, known->outcome == ContractOutcome::rejected ? "rejected" : "reset");
+  }
+
+  ContractPlan plan = ContractPlan::solve(caps, hold_voltage, _boost_efficiency, required_power());
+  _contract_cache.store(_plan_fingerprint, plan);
+  return plan;
+}
+
+void PowerMux::set_plan_outcome(ContractOutcome outcome) {
+  _contract_cache.set_outcome(_plan_fingerprint, outcome);
+}
+
+void PowerMux::set_config_store(ConfigStore& store) {
+  _config_store = &store;
+  if(_contract_cache.load(store)) {
+    rtt_printf("Contract cache loaded");
+  }
+}
 
-  // Port B Inflight check
-  if(_port_b_requested) {
+void PowerMux::save_contract_cache() {
+  if(!_config_store || !_contract_cache.dirty()) {
     return;
   }
 
-  // Request the highest power on port B
-  if(!_port_b_ps_rdy && _control_b.caps().count() > 0) {
-    for(uint8_t index = 0; index < port_b_cap_count; index++) {
-      if(port_b_max_powers[index] >= port_b_max_power) {
-        port_b_max_power = port_b_max_powers[index];
-        port_b_max_power_cap = index;
-      }
+  // Writing flash holds up the main loop so wait for the requests to finish and a new output to settle
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    if(_ports[port_number].requested) {
+      return;
     }
-    _port_b_selected_cap = _control_b.caps().caps()[port_b_max_power_cap];
-    _port_b_accepted = false;
-    _port_b_ps_rdy = false;
-    _port_b_requested = true;
-    rtt_printf("Port B Request - Cap %d -> %dmV @ %dmA", _port_b_selected_cap.index(), _port_b_selected_cap.voltage(), _port_b_selected_cap.current());
-    _control_b.request_capability(_port_b_selected_cap);
   }
+  if(_dishy_power.is_power_enabled() && system_time() - _output_time < CONTRACT_CACHE_RESET_WINDOW_MS) {
+    return;
+  }
+
+  _contract_cache.save(*_config_store);
+}
+
+bool PowerMux::is_port_ready(uint8_t port_number) {
+  // A port renegotiating in place is still running its old contract at the same voltage
+  const PowerPort& port = _ports[port_number];
+  return _plan.uses(port_number) && port.selected_index == _plan.index[port_number] &&
+         ((port.accepted && port.ps_rdy) || port.in_place);
 }
 
 uint32_t PowerMux::total_available_power() {
   uint32_t power = 0;
-  power += _port_a_selected_cap.max_power();
-  power += _port_b_selected_cap.max_power();
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    if(is_port_ready(port_number)) {
+      power += usable_power(_ports[port_number]);
+    }
+  }
   return power;
 }
 
+bool PowerMux::can_ride_through() {
+  return _plan.feasible && _boost_efficiency.output_power(_plan.voltage, total_available_power()) >= required_power();
+}
+
 void PowerMux::check_if_output_is_ready() {
-  // Check that we have enough power and the supplies have said we can draw power
-  if(active_supplies() == 1) {
-    rtt_printf("1 active sup");
-    if(_port_a_accepted && _port_a_ps_rdy && total_available_power() >= REQUIRED_OUTPUT_POWER_MW) {
-      rtt_printf("A acc & rdy");
-      _switch_a.set_current(_port_a_selected_cap.current());
-      _switch_a.set_enabled(true);
-      _dishy_power.enable_power();
-      status_light::set_color(0, 1, 0);
-      return;
+  // Check that every supply in the plan has its contract and has said we can draw power
+  bool any_used = false;
+  bool all_ready = true;
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    if(_plan.uses(port_number)) {
+      any_used = true;
+      all_ready = all_ready && is_port_ready(port_number);
     }
-    if(_port_b_accepted && _port_b_ps_rdy && total_available_power() >= REQUIRED_OUTPUT_POWER_MW) {
-      rtt_printf("B acc & rdy");
-      _switch_b.set_current(_port_b_selected_cap.current());
-      _switch_b.set_enabled(true);
-      _dishy_power.enable_power();
-      status_light::set_color(0, 1, 0);
-      return;
+  }
+
+  // Wait for the whole plan before turning the output on, once it's up it can carry on with whatever is ready
+  uint32_t power = _boost_efficiency.output_power(_plan.voltage, total_available_power());
+  // A shed load is latched off until the sources change
+  if(!_load_shed && ((any_used && all_ready) || _dishy_power.is_power_enabled()) && power >= required_power()) {
+    rtt_printf("Sups rdy - %dmW", power);
+    if(!_dishy_power.is_power_enabled() && power < load_profile(_load_profile_id).required_power) {
+      _marginal_enables++;
+      rtt_printf("Marginal out en - %dmW of %dmW - %d", power, load_profile(_load_profile_id).required_power, _marginal_enables);
     }
-  } else if(active_supplies() == 2) {
-    rtt_printf("2 active sup");
-    if(_port_a_accepted &&
-       _port_b_accepted &&
-       _port_a_ps_rdy &&
-       _port_b_ps_rdy &&
-       total_available_power() > REQUIRED_OUTPUT_POWER_MW &&
-       _port_a_selected_cap.voltage() == _port_b_selected_cap.voltage()) {
-      _switch_a.set_current(_port_a_selected_cap.current());
-      _switch_a.set_enabled(true);
-      _switch_b.set_current(_port_b_selected_cap.current());
-      _switch_b.set_enabled(true);
-      _dishy_power.enable_power();
-      status_light::set_color(0, 1, 0);
-      return;
-    } else  {
-      rtt_printf("Two incompat sups");
+
+    for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+      _ports[port_number].power_switch->set_enabled(is_port_ready(port_number));
     }
+    enable_output();
+    return;
+  }
+
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    _ports[port_number].power_switch->set_enabled(false);
   }
-  _switch_a.set_enabled(false);
-  _switch_b.set_enabled(false);
   _dishy_power.disable_power();
-  status_light::set_color(1, 1, 0);
+
+  // Keep showing that the load was shed until the sources change
+  if(_load_shed) {
+    status_light::set_color(1, 0, 1);
+  } else {
+    status_light::set_color(1, 1, 0);
+  }
+}
+
+void PowerMux::enable_output() {
+  if(_dishy_power.is_power_enabled()) {
+    return;
+  }
+
+  _dishy_power.set_supply_voltage(_plan.voltage);
+  _dishy_power.enable_power();
+  _output_time = system_time();
+  set_plan_outcome(ContractOutcome::accepted);
+  status_light::set_color(0, 1, 0);
+  rtt_printf("PS_RDY -> out en %d cyc", system_cycles() - _ps_rdy_cycles);
+
+  if(_attach_time != 0) {
+    rtt_printf("Attach -> out en %dms (%s)", system_time() - _attach_time, _negotiation_mode == NegotiationMode::serial ? "serial" : "parallel");
+    _attach_time = 0;
+  }
 }
 
 void PowerMux::reset(IController& controller) {
-  switch(get_controller(controller)) {
-    case ControllerIndex::a:
-      _switch_a.set_enabled(false);
-      _port_a_selected_cap = SourceCapability();
-      _port_a_accepted = false;
-      _port_a_ps_rdy = false;
-      _port_a_requested = false;
-      break;
+  uint8_t port_number = get_port_number(controller);
+  bool was_carrying = port_number != NO_PORT && _plan.uses(port_number);
+  if(port_number != NO_PORT) {
+    _ports[port_number].power_switch->set_enabled(false);
+    _ports[port_number].reset();
+    black_box::record(BlackBoxEvent::port_reset, port_number);
+  }
+  _load_shed = false;
 
-    case ControllerIndex::b:
-      _switch_b.set_enabled(false);
-      _dishy_power.disable_power();
-      _port_b_selected_cap = SourceCapability();
-      _port_b_accepted = false;
-      _port_b_ps_rdy = false;
-      _port_b_requested = false;
-      break;
+  hand_over(was_carrying);
+}
 
-    default:
-      break;
+void PowerMux::hand_over(bool was_carrying) {
+  bool output_enabled = _dishy_power.is_power_enabled();
+
+  // The solver holds the live voltage so the ports left keep their contracts if they can carry the load
+  check_available_power();
+  check_if_output_is_ready();
+
+  if(!output_enabled || !_dishy_power.is_power_enabled()) {
+    _attach_time = 0;
+    return;
+  }
+
+  // The ports left now carry the whole load so give them their full contract
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    PowerPort& port = _ports[port_number];
+    if(_plan.uses(port_number) && !port.in_place) {
+      set_port_current(port, port.contract.current());
+    }
+  }
+
+  if(was_carrying) {
+    _ride_throughs++;
+    status_light::set_color(0, 1, 0);
+    rtt_printf("Ride through - %dmW - %d", total_available_power(), _ride_throughs);
+  }
+}
+
+void PowerMux::set_port_current(PowerPort& port, uint32_t current) {
+  port.current_limit = current;
+  port.power_switch->set_current(current);
+}
+
+void PowerMux::tick() {
+  // The load is checked on every pass so it's shed before the source's OCP trips
+  check_load();
+
+  if(system_time() - _share_time < CURRENT_SHARE_PERIOD_MS) {
+    return;
+  }
+  _share_time = system_time();
+
+  check_load_profile();
+  share_current();
+  save_contract_cache();
+}
+
+void PowerMux::set_load_profile(LoadProfileId id) {
+  _detect_load_profile = false;
+  apply_load_profile(id);
+}
+
+void PowerMux::detect_load_profile() {
+  _detect_load_profile = true;
+  apply_load_profile(lightest_load_profile());
+}
+
+void PowerMux::apply_load_profile(LoadProfileId id) {
+  _load_profile_id = id;
+  const LoadProfile& profile = load_profile(id);
+  _dishy_power.set_load_profile(profile);
+  rtt_printf("Load profile %s - %dmW", profile.name, profile.required_power);
+
+  // Re-plan for the new requirement if a source is already connected, the output drops if the contracts can't carry it
+  if(_plan.voltage != 0) {
+    check_available_power();
+    check_if_output_is_ready();
+  }
+}
+
+void PowerMux::check_load_profile() {
+  if(!_detect_load_profile || _dishy_power.load_time() < LOAD_PROFILE_DETECT_WINDOW_MS) {
+    return;
+  }
+  _detect_load_profile = false;
+
+  LoadProfileId id = ::detect_load_profile(_dishy_power.peak_output_power());
+  rtt_printf("Load detect - peak %dmW", _dishy_power.peak_output_power());
+  if(id != _load_profile_id) {
+    apply_load_profile(id);
+  }
+}
+
+void PowerMux::share_current() {
+  if(!_dishy_power.is_power_enabled() || _plan.voltage == 0) {
+    return;
+  }
+
+  // Only ports running a settled contract take part, a single port just keeps its full contract
+  uint32_t total_contract_10ma = 0;
+  uint8_t sharing_ports = 0;
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    if(is_port_ready(port_number) && !_ports[port_number].in_place) {
+      total_contract_10ma += units::to_10ma(usable_current(_ports[port_number]));
+      sharing_ports++;
+    }
+  }
+
+  if(sharing_ports < 2 || total_contract_10ma == 0) {
+    return;
+  }
+
+  // Input current the boost draws at the measured peak load, never less than the load profile needs
+  // The peak is 0 just after the output comes up and decays through quiet spells, the dish's next surge
+  // would trip the switches if the limits followed it down
+  uint32_t demand_power = _dishy_power.peak_output_power();
+  uint32_t profile_power = load_profile(_load_profile_id).required_power;
+  if(demand_power < profile_power) {
+    demand_power = profile_power;
+  }
+  uint32_t input_power = _boost_efficiency.input_power(_plan.voltage, demand_power);
+  uint32_t demand_10ma = units::divide(input_power * 2, units::to_50mv(_plan.voltage));
+
+  for(uint8_t port_number = 0; port_number < POWER_MUX_PORT_COUNT; port_number++) {
+    PowerPort& port = _ports[port_number];
+    if(!is_port_ready(port_number) || port.in_place) {
+      continue;
+    }
+
+    // Cap each supply at its share of the load so the stiffer one can't take it all, but never past its contract
+    uint32_t contract_10ma = units::to_10ma(usable_current(port));
+    uint32_t share_10ma = units::divide(demand_10ma * contract_10ma, total_contract_10ma) + (contract_10ma >> CURRENT_SHARE_HEADROOM_SHIFT);
+    uint32_t limit = units::from_10ma(share_10ma < contract_10ma ? share_10ma : contract_10ma);
+
+    uint32_t change = limit > port.current_limit ? limit - port.current_limit : port.current_limit - limit;
+    if(change >= CURRENT_SHARE_HYSTERESIS_MA) {
+      rtt_printf("Port %c share - %dmA of %dmA", port_name(port_number), limit, port.contract.current());
+      set_port_current(port, limit);
+    }
   }
 }
 
-uint8_t PowerMux::active_supplies() {
-  uint8_t has_caps = 0;
-  if(_control_a.caps().count() > 0) { has_caps++; }
-  if(_control_b.caps().count() > 0) { has_caps++; }
-  return has_caps;
+uint32_t PowerMux::usable_current(const PowerPort& port) {
+  uint32_t current = port.contract.current();
+  return port.status.overloaded() ? current - (current >> SOURCE_OVERLOAD_DERATE_SHIFT) : current;
 }
 
+uint32_t PowerMux::usable_power(const PowerPort& port) {
+  uint32_t power = get_port_cap(port).max_power();
+  return port.status.overloaded() ? power - (power >> SOURCE_OVERLOAD_DERATE_SHIFT) : power;
+}
+
+uint32_t PowerMux::required_power() {
+  const LoadProfile& profile = load_profile(_load_profile_id);
+  if(_admission_mode == AdmissionMode::measured && !_load_shed) {
+    return profile.admit_power;
+  }
+  return profile.required_power;
+}
+
+void PowerMux::check_load() {
+  if(_admission_mode != AdmissionMode::measured || !_dishy_power.is_power_enabled()) {
+    return;
+  }
+
+  uint32_t available = total_available_power();
+  uint32_t input = _boost_efficiency.input_power(_plan.voltage, _dishy_power.output_power());
+  if(available == 0) {
+    return;
+  }
+
+  // Keep track of how close the measured draw gets to the contracts
+  uint32_t available_250mw = units::to_250mw(available);
+  uint32_t load_percent = available_250mw > 0 ? units::divide(units::to_250mw(input) * 100, available_250mw) : 0;
+  if(load_percent > _peak_load_percent) {
+    _peak_load_percent = load_percent;
+  }
+
+  if(input * 100 < available * LOAD_SHED_PERCENT) {
+    return;
+  }
+
+  // Drop the output before the source trips, it stays off until new caps or a reset
+  _load_shed = true;
+  _load_sheds++;
+  rtt_printf("Load shed - %dmW of %dmW - shed %d of %d marginal, peak %d%%", input, available, _load_sheds, _marginal_enables, _peak_load_percent);
+
+  check_if_output_is_ready();
+}
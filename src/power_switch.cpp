@@ -3,8 +3,11 @@
 #include "registers/rcc.h"
 #include "registers/gpio.h"
 #include "rtt.h"
+#include "units.h"
 
-#define CURRENT_LIMIT_RATIO 90000000 // mA * Ohm
+#define CURRENT_LIMIT_RATIO_10MA 9000000 // 10mA * Ohm
+#define MIN_LIMIT_RESISTANCE 7000
+#define MAX_LIMIT_RESISTANCE 70000
 
 void PowerSwitch::init() {
   // Power switches are all on port B so all init will assume port B
@@ -19,22 +22,29 @@ void PowerSwitch::init() {
 
 void PowerSwitch::set_current(uint32_t current) {
   _current = current + 400; // Add a little buffer for error in the digipot
+  uint32_t resistance = current_to_resistance(_current);
+
+  rtt_printf("PS %dmA -> %dohm", current, resistance);
+
+  _digipot.set_resistance(resistance);
+}
+
+uint32_t PowerSwitch::current_to_resistance(uint32_t current) {
   // Power switch expects a value between 7k and 70k ohms
-  // First calculate the desired resistance based on the input current in milliamps
-  uint32_t resistance = CURRENT_LIMIT_RATIO / (_current > 0 ? _current : 1);
+  // Work in 10mA steps so the divisor stays inside the reciprocal table
+  uint32_t current_10ma = units::to_10ma(current);
+  uint32_t resistance = units::divide(CURRENT_LIMIT_RATIO_10MA, current_10ma > 0 ? current_10ma : 1);
 
   // Clamp the resistance
-  if(resistance < 7000) {
-    resistance = 7000;
+  if(resistance < MIN_LIMIT_RESISTANCE) {
+    resistance = MIN_LIMIT_RESISTANCE;
   }
 
-  if(resistance > 70000) {
-    resistance = 70000;
+  if(resistance > MAX_LIMIT_RESISTANCE) {
+    resistance = MAX_LIMIT_RESISTANCE;
   }
 
-  rtt_printf("PS %dmA -> %dohm", current, resistance);
-
-  _digipot.set_resistance(resistance);
+  return resistance;
 }
 
 void PowerSwitch::set_enabled(bool enabled) {
@@ -0,0 +1,28 @@
+#include "sink_capabilities.h"
+
+
+// Little endian bytes of one PDO for the default profile
+#define SINK_PDO_BYTES(index) \
+  (uint8_t)(sink_capabilities::pdo(index, load_profile_required_power(DEFAULT_LOAD_PROFILE)) & 0xFF), \
+  (uint8_t)((sink_capabilities::pdo(index, load_profile_required_power(DEFAULT_LOAD_PROFILE)) >> 8) & 0xFF), \
+  (uint8_t)((sink_capabilities::pdo(index, load_profile_required_power(DEFAULT_LOAD_PROFILE)) >> 16) & 0xFF), \
+  (uint8_t)(sink_capabilities::pdo(index, load_profile_required_power(DEFAULT_LOAD_PROFILE)) >> 24)
+
+static_assert(SINK_CAPABILITY_COUNT == 5, "Sink PDO list out of step with the count");
+static_assert(SINK_CAPABILITY_COUNT <= MAX_CAPABILITIES, "Too many sink PDOs for one message");
+static_assert(sink_capabilities::voltage(0) == 5000, "First sink PDO has to be vSafe5V");
+static_assert(sink_capabilities::current_10ma(20000, 78000) == 500, "Sink current sizing");
+static_assert(sink_capabilities::pdo(4, 93000) == fixed_pdo::encode(400, 300), "Sink current limit");
+static_assert(sink_capabilities::operational_pdp(93000) == 120, "Sink operational PDP");
+static_assert(sink_capabilities::operational_pdp(load_profile_required_power(DEFAULT_LOAD_PROFILE)) <= 0xFF, "PDP has to fit the EPR_Mode data field");
+
+
+const uint8_t sink_capability_objects[SINK_CAPABILITIES_SIZE] = {
+  SINK_PDO_BYTES(0),
+  SINK_PDO_BYTES(1),
+  SINK_PDO_BYTES(2),
+  SINK_PDO_BYTES(3),
+  SINK_PDO_BYTES(4),
+};
+
+const uint8_t sink_operational_pdp = sink_capabilities::operational_pdp(load_profile_required_power(DEFAULT_LOAD_PROFILE));
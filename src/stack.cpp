@@ -0,0 +1,61 @@
+#include "stack.h"
+
+#include "rtt.h"
+
+
+// Provided by the linker
+extern unsigned __stack_bottom__;
+extern unsigned _stack_ptr;
+
+
+namespace {
+
+
+// Background scan position and the deepest word found so far
+const unsigned* scan_address = &__stack_bottom__;
+const unsigned* deepest_address = &_stack_ptr;
+
+
+uint32_t depth(const unsigned* address) {
+  return (uint32_t)&_stack_ptr - (uint32_t)address;
+}
+
+
+} // namespace
+
+
+namespace stack {
+
+
+uint32_t size() {
+  return depth(&__stack_bottom__);
+}
+
+uint32_t high_water_mark() {
+  const unsigned* address = &__stack_bottom__;
+  while(address < &_stack_ptr && *address == STACK_PAINT_WORD) {
+    address++;
+  }
+  return depth(address);
+}
+
+void tick() {
+  // Words below the last mark were all still painted last time so only they need checking
+  for(uint32_t index = 0; index < STACK_SCAN_WORDS; index++) {
+    if(scan_address >= deepest_address) {
+      scan_address = &__stack_bottom__;
+      return;
+    }
+
+    if(*scan_address != STACK_PAINT_WORD) {
+      deepest_address = scan_address;
+      scan_address = &__stack_bottom__;
+      rtt_printf("Stack high water %d of %d bytes", depth(deepest_address), size());
+      return;
+    }
+    scan_address++;
+  }
+}
+
+
+} // namespace stack
@@ -2,6 +2,8 @@
  * @brief Application startup code responsible for prepping memory for execution
  */
 
+#include "stack.h"
+
 extern int main(void);
 
 // Symbols from the linker for init purposes
@@ -14,6 +16,8 @@ extern unsigned __data_end__;
 extern unsigned __bss_start__;
 extern unsigned __bss_end__;
 
+extern unsigned __stack_bottom__;
+
 // CPP CTor and DTor lists
 typedef void (*InitFunc)();
 extern InitFunc __preinit_array_start__[];
@@ -27,6 +31,16 @@ extern InitFunc __fini_array_end__[];
 
 
 // Setup helpers
+void paint_stack() {
+  // Everything under the live stack is unused at reset, mark it so the deepest use can be found later
+  unsigned *dest, *end;
+  dest = &__stack_bottom__;
+  asm volatile("mov %0, sp" : "=r" (end));
+  while(dest < end) {
+    *dest++ = STACK_PAINT_WORD;
+  }
+}
+
 void copy_data() {
   // Copy .data into RAM
   unsigned *src, *dest;
@@ -72,6 +86,7 @@ void call_finalizers() {
 // Do all relevant early system init here
 void Reset_Handler(void) {
   // System setup
+  paint_stack();
   copy_data();
   zero_data();
   call_initializers();
@@ -1,11 +1,13 @@
 #include "stm_pd.h"
 
+#include "black_box.h"
 #include "circular_buffer.h"
 #include "registers/dma.h"
 #include "registers/pd.h"
 #include "registers/rcc.h"
 #include "registers/syscfg.h"
 #include "rtt.h"
+#include "sink_capabilities.h"
 #include "status_light.h"
 #include "time.h"
 #include "utils.h"
@@ -23,11 +25,37 @@
 #define ORDSET_SOP_PRIMEPRIME (K_CODE_SYNC1 | (K_CODE_SYNC3 << 5) | (K_CODE_SYNC1 << 10) | (K_CODE_SYNC3 << 15))
 #define ORDSET_HARD_RESET     (K_CODE_RST1  | (K_CODE_RST1  << 5) | (K_CODE_RST1  << 10) | (K_CODE_RST2  << 15))
 
-constexpr uint32_t vsafe5v_sink_cap_buf_size() {
-  return sizeof(MessageHeader) + sizeof(FixedPowerDataObject);
+static_assert(PD_HEADER_SIZE + SINK_CAPABILITIES_SIZE <= PD_BUFFER_SIZE, "Sink caps don't fit in a TX message");
+static_assert(PD_HEADER_SIZE + PD_EXTENDED_HEADER_SIZE + PD_MAX_EXTENDED_MSG_CHUNK_LEN <= PD_BUFFER_SIZE, "Extended chunks don't fit in an RX message");
+static_assert(PD_CHUNK_REQUEST_SIZE <= PD_BUFFER_SIZE, "Chunk requests don't fit in a TX message");
+
+
+namespace {
+
+
+// Control messages that open a new message sequence rather than answer one
+bool starts_ams(ControlMessageType message_type) {
+  switch(message_type) {
+    case ControlMessageType::get_source_cap:
+    case ControlMessageType::get_sink_cap:
+    case ControlMessageType::dr_swap:
+    case ControlMessageType::pr_swap:
+    case ControlMessageType::vconn_swap:
+    case ControlMessageType::get_source_cap_extended:
+    case ControlMessageType::get_status:
+    case ControlMessageType::get_pps_status:
+    case ControlMessageType::get_country_codes:
+    case ControlMessageType::get_sink_cap_extended:
+      return true;
+    default:
+      return false;
+  }
 }
 
 
+} // namespace
+
+
 STMPD::STMPD(PDPort port) : _port(port) {}
 
 void STMPD::init() {
@@ -54,6 +82,9 @@ void STMPD::init() {
   REGISTER(_base_addr + PD_CFG1_OFFSET) |=  (0x0D | (0x10 << 6) | (0x08 << 11) | (0x1 << 17) | ((BIT_0 | BIT_3) << 20) | BIT_29 | BIT_30);
   REGISTER(_base_addr + PD_CFG1_OFFSET) |=  BIT_31;
 
+  // The RX DMA always has a block to fill
+  _rx_block = message_pool::acquire((uint8_t)_port);
+
   // Setup DMA for RX first
   // Port 1 -> DMA Chan 1
   // Port 2 -> DMA Chan 2
@@ -64,7 +95,7 @@ void STMPD::init() {
       DMA_1_CNDTR1 &= ~(0x0000FFFF);
       DMA_1_CNDTR1 |=  PD_BUFFER_SIZE;
       DMA_1_CPAR1  = _base_addr + PD_RXDR_OFFSET;
-      DMA_1_CMAR1  = (uint32_t)_rx_buff_a.buffer;
+      DMA_1_CMAR1  = (uint32_t)message_pool::message(_rx_block).buffer;
 
       // Setup DMAMUX Channel 1- UCPD1_RX -> MUX Input 58
       DMA_MUX_C0CR &= ~((0xF << 24) | (0x3 << 17) | BIT_16 | BIT_9 | BIT_8 | (0x7F));
@@ -80,7 +111,7 @@ void STMPD::init() {
       DMA_1_CNDTR2 &= ~(0x0000FFFF);
       DMA_1_CNDTR2 |=  PD_BUFFER_SIZE;
       DMA_1_CPAR2  = _base_addr + PD_RXDR_OFFSET;
-      DMA_1_CMAR2  = (uint32_t)_rx_buff_a.buffer;
+      DMA_1_CMAR2  = (uint32_t)message_pool::message(_rx_block).buffer;
 
       // Setup DMAMUX Channel 2- UCPD2_RX -> MUX Input 60
       DMA_MUX_C1CR &= ~((0xF << 24) | (0x3 << 17) | BIT_16 | BIT_9 | BIT_8 | (0x7F));
@@ -147,11 +178,15 @@ void STMPD::init() {
 
 void STMPD::tick() {
 	if(_rx_message_buff.can_pop()) {
-    auto message = _rx_message_buff.pop();
-    if(message.hard_reset) {
+    uint8_t block = _rx_message_buff.pop();
+    if(block == PD_HARD_RESET_BLOCK) {
       handle_hard_reset();
+    } else if(block == PD_DETACH_BLOCK) {
+      handle_detach();
     } else {
+      const PDMessage& message = message_pool::message(block);
       handle_rx_buffer(message.buffer, message.size);
+      message_pool::release(block);
     }
 	}
   if(_caps_rx_timer != 0 && (system_time() - _caps_rx_timer) > 100) {
@@ -164,6 +199,23 @@ void STMPD::tick() {
     _hard_reset_timer = 0;
   }
 
+  if(_pps_request != 0 && !_ams_pending && (system_time() - _pps_request_time) > PPS_KEEP_ALIVE_MS) {
+    // The source answers with accept and PS_RDY which are kept from the delegate
+    _keep_alive_inflight = true;
+    _pps_request_time = system_time();
+    send_request(_pps_request);
+  }
+
+  // A message already waiting to go out keeps EPR alive just as well
+  if(_epr_active && !_ams_pending && (system_time() - _epr_keep_alive_time) > EPR_KEEP_ALIVE_MS) {
+    _epr_keep_alive_time = system_time();
+    send_extended_control(ExtendedControlType::epr_keep_alive);
+  }
+
+  check_follow_ups();
+  release_ams();
+  _extended_rx.check_timeout();
+
   if(_tx_message_buff.can_pop()) {
     start_tx_dma();
   }
@@ -181,10 +233,8 @@ void STMPD::handle_interrupt() {
 
   if(ifs & BIT_10) {
     // Hard reset detected
-    RXMessage rx_hard_reset;
-    rx_hard_reset.hard_reset = true;
     if(_rx_message_buff.can_push()) {
-      _rx_message_buff.push(rx_hard_reset);
+      _rx_message_buff.push(PD_HARD_RESET_BLOCK);
     }
     REGISTER(_base_addr + PD_ICR_OFFSET) |= BIT_10;
   }
@@ -198,29 +248,34 @@ void STMPD::handle_interrupt() {
   if(ifs & BIT_2) {
     // TX DMA Complete
     _tx_dma_inflight = false;
-    _tx_message_buff.pop();
+    // The block being sent stays at the head of the queue until now, the check only guards a stray interrupt
+    if(_tx_message_buff.can_pop()) {
+      message_pool::release(_tx_message_buff.pop());
+    }
     REGISTER(_base_addr + PD_ICR_OFFSET) |= BIT_2;
   }
 }
 
 void STMPD::send_control_msg(ControlMessageType message_type) {
+  if(starts_ams(message_type)) {
+    uint8_t buffer[PD_HEADER_SIZE] = {0};
+    store_le16(buffer, header::encode((uint8_t)message_type, _spec_rev, 0, 0));
+    start_ams(buffer, sizeof(buffer));
+    return;
+  }
   send_control_msg(message_type, _message_id_counter++);
 }
 
 void STMPD::send_control_msg(ControlMessageType message_type, uint8_t index) {
-  MessageHeader message;
-  setmem(&message, 0, sizeof(MessageHeader));
+  uint8_t buffer[PD_HEADER_SIZE] = {0};
+  store_le16(buffer, header::encode((uint8_t)message_type, _spec_rev, index & 0x07, 0));
 
-  message.message_type = (uint8_t)message_type;
-  message.num_data_obj = 0;
-  message.spec_rev = 1;
-  message.message_id = index & 0x07;
-
-  send_buffer((uint8_t*)&message, sizeof(message));
+  send_buffer(buffer, sizeof(buffer));
 }
 
 void STMPD::send_hard_reset() {
   _message_id_counter = 0;
+  black_box::record(BlackBoxEvent::pd_hard_reset, (uint8_t)_port, 1);
   REGISTER(_base_addr + PD_CR_OFFSET) |= BIT_3;
 }
 
@@ -231,52 +286,199 @@ void STMPD::request_capability(const SourceCapability& capability) {
 
 void STMPD::request_capability(const SourceCapability& capability, uint32_t power) {
   Request request(capability, power);
-  MessageHeader request_header;
-  setmem(&request_header, 0, sizeof(MessageHeader));
-
   uint32_t pdo = request.generate_pdo();
 
-  request_header.num_data_obj = 1;
-  request_header.message_type = (uint8_t)DataMessageType::request;
-  request_header.spec_rev = (uint8_t)SpecificationRev::two_v_zero;
-  request_header.message_id = _message_id_counter++ & 0x07;
+  // Sources only take an EPR_Mode entry from a sink that said it can do EPR in its request
+  if(_epr_enabled) {
+    pdo |= request_do::EPRModeCapable::set(1);
+  }
+  _request_pdo = capability.pdo();
+
+  // PPS contracts have to be refreshed so tick sends the same request again
+  _pps_request = request.needs_keep_alive() ? pdo : 0;
+  _pps_request_time = system_time();
+  _keep_alive_inflight = false;
+
+  send_request(pdo);
+}
+
+void STMPD::send_request(uint32_t pdo) {
+  // In EPR mode every request is an EPR_Request carrying a copy of the PDO it asks for
+  uint8_t buffer[PD_HEADER_SIZE + 2 * PD_DATA_OBJECT_SIZE] = {0};
+  uint8_t object_count = _epr_active ? 2 : 1;
+  uint8_t message_type = (uint8_t)(_epr_active ? DataMessageType::epr_request : DataMessageType::request);
+  uint32_t size = PD_HEADER_SIZE + object_count * PD_DATA_OBJECT_SIZE;
+  store_le32(buffer + PD_HEADER_SIZE, pdo);
+  store_le32(buffer + PD_HEADER_SIZE + PD_DATA_OBJECT_SIZE, _request_pdo);
+
+  // Answering capabilities is part of the source's sequence, anything later is the sink starting its own
+  if(!_caps_pending) {
+    store_le16(buffer, header::encode(message_type, _spec_rev, 0, object_count));
+    start_ams(buffer, size);
+    return;
+  }
+
+  _caps_pending = false;
+  store_le16(buffer, header::encode(message_type, _spec_rev, _message_id_counter++ & 0x07, object_count));
+  send_buffer(buffer, size);
+}
+
+void STMPD::send_extended_control(ExtendedControlType control_type) {
+  uint8_t buffer[PD_HEADER_SIZE + PD_DATA_OBJECT_SIZE] = {0};
+  store_le16(buffer, header::encode_extended((uint8_t)ExtendedMessageType::extended_control, _spec_rev, 0, 1));
+  store_le16(buffer + PD_HEADER_SIZE, extended_header::encode(2, 0, false));
+  buffer[PD_HEADER_SIZE + PD_EXTENDED_HEADER_SIZE] = (uint8_t)control_type;
+  start_ams(buffer, sizeof(buffer));
+}
+
+void STMPD::check_epr_entry() {
+  // One attempt per attach once the first SPR contract is in place
+  if(!_epr_enabled || !_epr_capable || _epr_active || _epr_entry_sent || _spec_rev < SpecificationRev::three_v_zero) {
+    return;
+  }
+  _epr_entry_sent = true;
+
+  uint8_t buffer[PD_HEADER_SIZE + PD_DATA_OBJECT_SIZE] = {0};
+  store_le16(buffer, header::encode((uint8_t)DataMessageType::epr_mode, _spec_rev, 0, 1));
+  store_le32(buffer + PD_HEADER_SIZE, epr_mode_do::encode(EPRModeAction::enter, sink_operational_pdp));
+  start_ams(buffer, sizeof(buffer));
+  rtt_printf("EPR enter - %dW", sink_operational_pdp);
+}
+
+void STMPD::check_follow_ups() {
+  // Sequences after the contract go out one at a time, the source's details first and then EPR
+  if(!_explicit_contract || _ams_pending) {
+    return;
+  }
+
+  if(!_source_info_requested && _spec_rev >= SpecificationRev::three_v_zero) {
+    _source_info_requested = true;
+    send_control_msg(ControlMessageType::get_source_cap_extended);
+    return;
+  }
+
+  check_epr_entry();
+}
 
-  uint8_t buffer[6] = {0};
-  cpymem(buffer, &request_header, sizeof(MessageHeader));
-  cpymem(buffer + 2, &pdo, sizeof(uint32_t));
+void STMPD::send_data_msg(DataMessageType message_type, const uint8_t* objects, uint8_t object_count) {
+  // Objects go straight from the caller, usually flash, into the TX block
+  uint8_t block = message_pool::acquire((uint8_t)_port);
+  if(block == MESSAGE_POOL_NO_BLOCK) {
+    return;
+  }
 
-  send_buffer(buffer, 6);
+  PDMessage& msg = message_pool::message(block);
+  msg.size = PD_HEADER_SIZE + object_count * PD_DATA_OBJECT_SIZE;
+  store_le16(msg.buffer, header::encode((uint8_t)message_type, _spec_rev, _message_id_counter++ & 0x07, object_count));
+  cpymem(msg.buffer + PD_HEADER_SIZE, objects, object_count * PD_DATA_OBJECT_SIZE);
+
+  queue_tx(block);
 }
 
 void STMPD::send_buffer(const uint8_t* buffer, uint32_t size) {
-  TXMessage msg;
+  uint8_t block = message_pool::acquire((uint8_t)_port);
+  if(block == MESSAGE_POOL_NO_BLOCK) {
+    return;
+  }
+
+  PDMessage& msg = message_pool::message(block);
   msg.size = size;
   cpymem(msg.buffer, buffer, size);
 
-  if(_tx_message_buff.can_push()) {
-    _tx_message_buff.push(msg);
+  queue_tx(block);
+}
+
+void STMPD::queue_tx(uint8_t block) {
+  // The block goes back to the pool if the queue is full, same as the message being dropped
+  if(!_tx_message_buff.can_push()) {
+    message_pool::release(block);
+    return;
   }
 
+  record_tx(load_le16(message_pool::message(block).buffer));
+  _tx_message_buff.push(block);
   start_tx_dma();
 }
 
+void STMPD::record_tx(uint16_t msg_header) {
+  // GoodCRCs would push everything else out of the black box
+  bool good_crc = header::NumDataObjects::get(msg_header) == 0 && !header::Extended::get(msg_header) &&
+                  (ControlMessageType)header::MessageType::get(msg_header) == ControlMessageType::good_crc;
+  if(!good_crc) {
+    black_box::record(BlackBoxEvent::pd_tx, (uint8_t)_port, msg_header);
+  }
+}
+
+bool STMPD::sink_tx_ok() {
+  // PD 2.0 sources don't signal so the sink can always transmit
+  if(_spec_rev < SpecificationRev::three_v_zero) {
+    return true;
+  }
+
+  uint32_t pd_status = REGISTER(_base_addr + PD_SR_OFFSET);
+  uint32_t cc_state = (REGISTER(_base_addr + PD_CR_OFFSET) & BIT_6) ? (pd_status >> 18) & 0x3 : (pd_status >> 16) & 0x3;
+  return cc_state == TYPEC_VSTATE_RP_3A;
+}
+
+void STMPD::start_ams(const uint8_t* buffer, uint32_t size) {
+  // Only one sequence is started at a time, a newer one replaces a message still waiting
+  if(_ams_block == MESSAGE_POOL_NO_BLOCK) {
+    _ams_block = message_pool::acquire((uint8_t)_port);
+    if(_ams_block == MESSAGE_POOL_NO_BLOCK) {
+      return;
+    }
+  }
+
+  PDMessage& message = message_pool::message(_ams_block);
+  cpymem(message.buffer, buffer, size);
+  message.size = size;
+  _ams_pending = true;
+
+  release_ams();
+}
+
+void STMPD::release_ams() {
+  if(!_ams_pending || !sink_tx_ok() || !_tx_message_buff.can_push()) {
+    return;
+  }
+
+  // The ID and revision are filled in now so they stay in order with anything sent while it waited
+  PDMessage& message = message_pool::message(_ams_block);
+  uint16_t msg_header = load_le16(message.buffer);
+  msg_header = header::MessageID::replace(msg_header, _message_id_counter++ & 0x07);
+  msg_header = header::SpecRev::replace(msg_header, (uint8_t)_spec_rev);
+  store_le16(message.buffer, msg_header);
+
+  uint8_t block = _ams_block;
+  _ams_block = MESSAGE_POOL_NO_BLOCK;
+  _ams_pending = false;
+  queue_tx(block);
+}
+
+void STMPD::cancel_ams() {
+  message_pool::release(_ams_block);
+  _ams_block = MESSAGE_POOL_NO_BLOCK;
+  _ams_pending = false;
+}
+
 void STMPD::handle_rx_dma() {
-  bool buffer_a = true;
   uint32_t dma_payload_size = 0;
 
+  // Move the DMA to a fresh block while this one is handled, with the pool empty it fills the same block again
+  uint8_t filled_block = _rx_block;
+  uint8_t next_block = message_pool::acquire((uint8_t)_port);
+  if(next_block != MESSAGE_POOL_NO_BLOCK) {
+    _rx_block = next_block;
+  }
+  uint32_t rx_address = (uint32_t)message_pool::message(_rx_block).buffer;
+
   // Handle the DMA specific shit first
   switch(_port) {
     case PDPort::one:
-      // Setup the DMA on the other buffer while we process this one
+      // Setup the DMA on the next block while we process this one
       dma_payload_size = PD_BUFFER_SIZE - DMA_1_CNDTR1;
       DMA_1_CCR1 &= ~(BIT_0);
-
-      if(DMA_1_CMAR1 == (uint32_t)_rx_buff_a.buffer) {
-        DMA_1_CMAR1 = (uint32_t)_rx_buff_b.buffer;
-      } else {
-        buffer_a = false;
-        DMA_1_CMAR1 = (uint32_t)_rx_buff_a.buffer;
-      }
+      DMA_1_CMAR1 = rx_address;
 
       // Reset the buffer size and enable the channel
       DMA_1_CNDTR1 = PD_BUFFER_SIZE;
@@ -284,16 +486,10 @@ void STMPD::handle_rx_dma() {
       break;
 
     case PDPort::two:
-      // Setup the DMA on the other buffer while we process this one
+      // Setup the DMA on the next block while we process this one
       dma_payload_size = PD_BUFFER_SIZE - DMA_1_CNDTR2;
       DMA_1_CCR2 &= ~(BIT_0);
-
-      if(DMA_1_CMAR2 == (uint32_t)_rx_buff_a.buffer) {
-        DMA_1_CMAR2 = (uint32_t)_rx_buff_b.buffer;
-      } else {
-        buffer_a = false;
-        DMA_1_CMAR2 = (uint32_t)_rx_buff_a.buffer;
-      }
+      DMA_1_CMAR2 = rx_address;
 
       // Reset the buffer size and enable the channel
       DMA_1_CNDTR2 = PD_BUFFER_SIZE;
@@ -304,38 +500,81 @@ void STMPD::handle_rx_dma() {
       break;
   }
 
+  // Dropped, the pool counts it
+  if(next_block == MESSAGE_POOL_NO_BLOCK) {
+    return;
+  }
+
   // Get the payload size and check it against the DMA
   uint32_t payload_size = REGISTER(_base_addr + PD_RX_PAYSZ_OFFSET);
-  if(payload_size == dma_payload_size) {
-    if(buffer_a) {
-      _rx_buff_a.size = payload_size;
-      if(_rx_message_buff.can_push()) {
-        _rx_message_buff.push(_rx_buff_a);
-      }
-    } else {
-      _rx_buff_b.size = payload_size;
-      if(_rx_message_buff.can_push()) {
-        _rx_message_buff.push(_rx_buff_b);
-      }
-    }
+  if(payload_size == dma_payload_size && _rx_message_buff.can_push()) {
+    message_pool::message(filled_block).size = payload_size;
+    _rx_message_buff.push(filled_block);
     return;
   }
 
-  rtt_printf("PD Pyld Sz Err - %d != %d", payload_size, dma_payload_size);
+  message_pool::release(filled_block);
+  if(payload_size != dma_payload_size) {
+    rtt_printf("PD Pyld Sz Err - %d != %d", payload_size, dma_payload_size);
+  }
 }
 
 void STMPD::handle_hard_reset() {
   _message_id_counter = 0;
+  _spec_rev = SpecificationRev::two_v_zero;
+  _caps_pending = false;
+  cancel_ams();
+  _pps_request = 0;
+  _keep_alive_inflight = false;
+  _epr_capable = false;
+  _epr_active = false;
+  _epr_entry_sent = false;
+  _explicit_contract = false;
+  _source_info_requested = false;
+  _source_status = SourceStatus();
+  _extended_rx.release();
   if(_delegate) {
     _delegate->reset_received(*this);
   }
   _source_caps = SourceCapabilities();
+  black_box::record(BlackBoxEvent::pd_hard_reset, (uint8_t)_port);
   rtt_printf("HRST RX");
 }
 
+void STMPD::handle_detach() {
+  // The next source starts from scratch
+  _spec_rev = SpecificationRev::two_v_zero;
+  _caps_pending = false;
+  cancel_ams();
+  _pps_request = 0;
+  _keep_alive_inflight = false;
+  _epr_capable = false;
+  _epr_active = false;
+  _epr_entry_sent = false;
+  _explicit_contract = false;
+  _source_info_requested = false;
+  _source_status = SourceStatus();
+  _extended_rx.release();
+
+  // Source was unplugged so let the delegate move the load off this port
+  if(_delegate) {
+    _delegate->controller_disconnected(*this);
+  }
+}
+
 void STMPD::handle_type_c_event() {
   // Check if one of the phys has a voltage on it
   uint32_t pd_status = REGISTER(_base_addr + PD_SR_OFFSET);
+  bool cc_active = (pd_status & 0x000F0000) != 0;
+
+  // PD 3.x sources move Rp between SinkTxOk and SinkTxNG while attached, that isn't a new attach
+  if(_attached && cc_active) {
+    REGISTER(_base_addr + PD_ICR_OFFSET) |= BIT_14 | BIT_15;
+    return;
+  }
+  bool was_attached = _attached;
+  _attached = cc_active;
+
   if(((pd_status & 0x00030000) >> 16) > 0) {
     // CC1 active, set the phy to use CC1
     REGISTER(_base_addr + PD_CR_OFFSET) &= ~(BIT_6);
@@ -355,6 +594,12 @@ void STMPD::handle_type_c_event() {
   } else {
     // No CC Active, disable RX
     REGISTER(_base_addr + PD_CR_OFFSET) &= ~(BIT_5);
+
+    // The detach is handled from tick, the delegate can't run in the ISR
+    // Only a source going away counts, not the check at init with nothing plugged in
+    if(was_attached && _rx_message_buff.can_push()) {
+      _rx_message_buff.push(PD_DETACH_BLOCK);
+    }
   }
 
   REGISTER(_base_addr + PD_ICR_OFFSET) |= BIT_14 | BIT_15;
@@ -364,46 +609,62 @@ void STMPD::handle_type_c_event() {
 }
 
 void STMPD::handle_rx_buffer(const uint8_t* buffer, uint32_t size) {
-  MessageHeader* msg_header = (MessageHeader*)buffer;
+  uint16_t msg_header = load_le16(buffer);
+  black_box::record(BlackBoxEvent::pd_rx, (uint8_t)_port, msg_header);
 
-  if(msg_header->num_data_obj == 0) {
+  // Extended message types overlap the data message types so they're split off first
+  if(header::Extended::get(msg_header)) {
+    send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
+    handle_extended_msg(buffer, size);
+    return;
+  }
+
+  if(header::NumDataObjects::get(msg_header) == 0) {
     // Control message received
-    ControlMessageType message_type = (ControlMessageType)(msg_header->message_type);
+    ControlMessageType message_type = (ControlMessageType)(header::MessageType::get(msg_header));
     switch(message_type) {
       case ControlMessageType::good_crc:
         _caps_rx_timer = 0;
         _hard_reset_timer = 0;
         break;
       case ControlMessageType::goto_min:
-        send_control_msg(ControlMessageType::good_crc, msg_header->message_id);
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
         if(_delegate) {
           _delegate->go_to_min_received(*this);
         }
         break;
       case ControlMessageType::accept:
-        send_control_msg(ControlMessageType::good_crc, msg_header->message_id);
-        if(_delegate) {
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
+        if(_delegate && !_keep_alive_inflight) {
           _delegate->accept_received(*this);
         }
         break;
       case ControlMessageType::reject:
-        send_control_msg(ControlMessageType::good_crc, msg_header->message_id);
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
+        _pps_request = 0;
+        _keep_alive_inflight = false;
         if(_delegate) {
           _delegate->reject_received(*this);
         }
         break;
       case ControlMessageType::ping:
-        send_control_msg(ControlMessageType::good_crc, msg_header->message_id);
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
         break;
       case ControlMessageType::ps_rdy:
-        send_control_msg(ControlMessageType::good_crc, msg_header->message_id);
-        if(_delegate) {
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
+        if(_keep_alive_inflight) {
+          _keep_alive_inflight = false;
+        } else if(_delegate) {
           _delegate->ps_ready_received(*this);
         }
+        _explicit_contract = true;
         break;
       case ControlMessageType::soft_reset:
-        send_control_msg(ControlMessageType::good_crc, msg_header->message_id);
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
         _message_id_counter = 0;
+        _pps_request = 0;
+        _keep_alive_inflight = false;
+        _explicit_contract = false;
         _source_caps = SourceCapabilities();
         if(_delegate) {
           _delegate->reset_received(*this);
@@ -411,64 +672,180 @@ void STMPD::handle_rx_buffer(const uint8_t* buffer, uint32_t size) {
         send_control_msg(ControlMessageType::accept);
         rtt_printf("SRST RX");
         break;
-      case ControlMessageType::get_sink_cap: {
-        send_control_msg(ControlMessageType::good_crc, msg_header->message_id);
-
-        uint8_t sink_caps_buffer[vsafe5v_sink_cap_buf_size() + 16] = {0};
-        MessageHeader* sink_caps_msg_header = (MessageHeader*)sink_caps_buffer;
-        sink_caps_msg_header->num_data_obj = 1;
-        sink_caps_msg_header->message_id = _message_id_counter++;
-        sink_caps_msg_header->spec_rev = (uint8_t)SpecificationRev::two_v_zero;
-        sink_caps_msg_header->message_type = (uint8_t)DataMessageType::sink_capabilities;
-
-        uint32_t bytes_written = 0;
-        vsafe5v_basic_sink_cap(sink_caps_buffer + 16, sizeof(sink_caps_buffer - 16), &bytes_written);
-
-        send_buffer(sink_caps_buffer, sizeof(sink_caps_buffer));
-        }
+      case ControlMessageType::wait:
+      case ControlMessageType::not_supported:
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
+        _keep_alive_inflight = false;
+        rtt_printf("Ctl msg %d RX", header::MessageType::get(msg_header));
+        break;
+      case ControlMessageType::get_sink_cap:
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
+        send_data_msg(DataMessageType::sink_capabilities, sink_capability_objects, SINK_CAPABILITY_COUNT);
         rtt_printf("Sink cap resp sent");
         break;
       default:
-        rtt_printf("Unhan ctl msg: %d", msg_header->message_type);
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
+        if(_spec_rev >= SpecificationRev::three_v_zero) {
+          send_control_msg(ControlMessageType::not_supported);
+        }
+        rtt_printf("Unhan ctl msg: %d", header::MessageType::get(msg_header));
         break;
     }
   } else {
     // Data message received
-    DataMessageType message_type = (DataMessageType)(msg_header->message_type);
+    DataMessageType message_type = (DataMessageType)(header::MessageType::get(msg_header));
     switch(message_type) {
       case DataMessageType::source_capabilities:
-        send_control_msg(ControlMessageType::good_crc, msg_header->message_id);
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
         _caps_rx_timer = 0;
         _hard_reset_timer = 0;
         handle_src_caps_msg(buffer, size);
         break;
       case DataMessageType::bist:
-        send_control_msg(ControlMessageType::good_crc, msg_header->message_id);
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
         break;
       case DataMessageType::sink_capabilities:
-        send_control_msg(ControlMessageType::good_crc, msg_header->message_id);
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
+        break;
+      case DataMessageType::alert:
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
+        handle_alert_msg(buffer, size);
+        break;
+      case DataMessageType::epr_mode:
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
+        handle_epr_mode_msg(buffer, size);
         break;
       case DataMessageType::vendor_defined:
-        send_control_msg(ControlMessageType::good_crc, msg_header->message_id);
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
         rtt_printf("VDM Req IGN");
         break;
       default:
+        send_control_msg(ControlMessageType::good_crc, header::MessageID::get(msg_header));
+        if(_spec_rev >= SpecificationRev::three_v_zero) {
+          send_control_msg(ControlMessageType::not_supported);
+        }
         break;
     }
   }
 }
 
 void STMPD::handle_src_caps_msg(const uint8_t* message, uint32_t len) {
-  MessageHeader* msg_hdr = (MessageHeader*)message;
-  PowerDataObject* pdos = (PowerDataObject*)(message + 2);
+  uint16_t msg_hdr = load_le16(message);
+  _source_caps = SourceCapabilities(message + PD_HEADER_SIZE, header::NumDataObjects::get(msg_hdr));
 
-  _source_caps = SourceCapabilities(pdos, msg_hdr->num_data_obj);
+  // Talk to the source at the lower of both revisions from here on
+  if(header::negotiate_spec_rev(msg_hdr) != _spec_rev) {
+    _spec_rev = header::negotiate_spec_rev(msg_hdr);
+    rtt_printf("PD rev %d", (uint8_t)_spec_rev + 1);
+  }
+  _caps_pending = true;
+  _keep_alive_inflight = false;
+
+  // The source says whether it can do EPR on its vSafe5V PDO
+  _epr_capable = _source_caps.count() > 0 && fixed_pdo::EPRModeCapable::get(_source_caps.pdo(0));
+
+  if(_delegate) {
+    _delegate->capabilities_received(*this, _source_caps);
+  }
+}
+
+void STMPD::handle_epr_src_caps_msg(const uint8_t* objects, uint32_t len) {
+  // Same handling as SPR caps, the EPR PDOs follow the 7 SPR positions
+  _source_caps = SourceCapabilities(objects, len / PD_DATA_OBJECT_SIZE);
+  _caps_pending = true;
+  _keep_alive_inflight = false;
+  rtt_printf("EPR caps RX - %d", _source_caps.count());
 
   if(_delegate) {
     _delegate->capabilities_received(*this, _source_caps);
   }
 }
 
+void STMPD::handle_epr_mode_msg(const uint8_t* message, uint32_t len) {
+  if(len < PD_HEADER_SIZE + PD_DATA_OBJECT_SIZE) {
+    return;
+  }
+
+  uint32_t epr_mode = load_le32(message + PD_HEADER_SIZE);
+  switch((EPRModeAction)epr_mode_do::Action::get(epr_mode)) {
+    case EPRModeAction::enter_succeeded:
+      // EPR source caps follow straight away
+      _epr_active = true;
+      _epr_keep_alive_time = system_time();
+      rtt_printf("EPR active");
+      break;
+    case EPRModeAction::enter_failed:
+      rtt_printf("EPR enter failed - %d", epr_mode_do::Data::get(epr_mode));
+      break;
+    case EPRModeAction::exit:
+      // SPR caps follow and the contract drops back with them
+      _epr_active = false;
+      rtt_printf("EPR exit");
+      break;
+    default:
+      break;
+  }
+}
+
+void STMPD::handle_alert_msg(const uint8_t* message, uint32_t len) {
+  if(len < PD_HEADER_SIZE + PD_DATA_OBJECT_SIZE) {
+    return;
+  }
+
+  // Pass on what the alert flags straight away and ask for the full status behind it
+  uint32_t alert = load_le32(message + PD_HEADER_SIZE);
+  rtt_printf("Src alert - %x", alert);
+  _source_status.update_alert(alert);
+  handle_status_update();
+  send_control_msg(ControlMessageType::get_status);
+}
+
+void STMPD::handle_status_update() {
+  if(_delegate) {
+    _delegate->status_received(*this, _source_status);
+  }
+}
+
+void STMPD::handle_extended_msg(const uint8_t* message, uint32_t len) {
+  switch(_extended_rx.receive(message, len)) {
+    case ChunkStatus::need_chunk: {
+      uint8_t buffer[PD_CHUNK_REQUEST_SIZE] = {0};
+      encode_chunk_request(buffer, _extended_rx.type(), _spec_rev, _message_id_counter++, _extended_rx.next_chunk());
+      send_buffer(buffer, sizeof(buffer));
+      break;
+    }
+    case ChunkStatus::complete:
+      switch(_extended_rx.type()) {
+        case ExtendedMessageType::epr_source_capabilities:
+          handle_epr_src_caps_msg(_extended_rx.message()->data, _extended_rx.message()->size);
+          break;
+        case ExtendedMessageType::source_capabilities_extended:
+          _source_status.update_extended_caps(_extended_rx.message()->data, _extended_rx.message()->size);
+          rtt_printf("Src PDP %dW", _source_status.pdp);
+          handle_status_update();
+          break;
+        case ExtendedMessageType::status:
+          _source_status.update_status(_extended_rx.message()->data, _extended_rx.message()->size);
+          rtt_printf("Src status - %dC temp %d ocp %d otp %d", _source_status.temperature, (uint8_t)_source_status.temperature_status,
+                     _source_status.over_current, _source_status.over_temperature);
+          handle_status_update();
+          break;
+        case ExtendedMessageType::extended_control:
+          // Only EPR keep alive acks come back
+          break;
+        default:
+          rtt_printf("Ext msg %d RX, %d bytes", (uint8_t)_extended_rx.type(), _extended_rx.message()->size);
+          send_control_msg(ControlMessageType::not_supported);
+          break;
+      }
+      _extended_rx.release();
+      break;
+    default:
+      rtt_printf("Ext msg dropped");
+      break;
+  }
+}
+
 void STMPD::enable_ints() {
   // Enable interrupts for Type C Events on CC1 and 2, RX Message End and RX hard reset
   REGISTER(_base_addr + PD_IMR_OFFSET) |= (BIT_15 | BIT_14 | BIT_12 | BIT_10 | BIT_2);
@@ -487,7 +864,7 @@ void STMPD::start_tx_dma() {
   _tx_dma_inflight = true;
 
   // Get the next message to send but don't pop it until it gets sent
-  auto& message = _tx_message_buff.peek();
+  PDMessage& message = message_pool::message(_tx_message_buff.peek());
 
   // Depend on port setup the DMA for TX
   // Port 1 -> Chan 3
@@ -34,3 +34,15 @@ void msleep(uint32_t milli_seconds) {
 uint32_t system_time() {
   return msec_clock;
 }
+
+uint32_t system_cycles() {
+  // Re-read if the systick rolled over between the two reads
+  uint32_t msec = 0;
+  uint32_t counts = 0;
+  do {
+    msec = msec_clock;
+    counts = STK_CVR;
+  } while(msec != msec_clock);
+
+  return (msec * CYCLES_PER_MS) + (CYCLES_PER_MS - counts);
+}
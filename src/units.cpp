@@ -0,0 +1,32 @@
+#include "units.h"
+
+// Expand the reciprocal table at compile time so it lives in flash
+#define RECIP_1(n)    units::reciprocal(n)
+#define RECIP_4(n)    RECIP_1(n), RECIP_1(n + 1), RECIP_1(n + 2), RECIP_1(n + 3)
+#define RECIP_16(n)   RECIP_4(n), RECIP_4(n + 4), RECIP_4(n + 8), RECIP_4(n + 12)
+#define RECIP_64(n)   RECIP_16(n), RECIP_16(n + 16), RECIP_16(n + 32), RECIP_16(n + 48)
+#define RECIP_256(n)  RECIP_64(n), RECIP_64(n + 64), RECIP_64(n + 128), RECIP_64(n + 192)
+#define RECIP_1024(n) RECIP_256(n), RECIP_256(n + 256), RECIP_256(n + 512), RECIP_256(n + 768)
+
+namespace {
+
+
+const uint32_t reciprocal_table[RECIPROCAL_TABLE_SIZE] = { RECIP_1024(0) };
+
+
+} // namespace
+
+
+namespace units {
+
+
+uint32_t divide(uint32_t dividend, uint32_t divisor) {
+  if(divisor >= RECIPROCAL_TABLE_SIZE) {
+    // Out of range of the table, fall back to the slow path
+    return dividend / divisor;
+  }
+  return divide(dividend, divisor, reciprocal_table[divisor]);
+}
+
+
+} // namespace units
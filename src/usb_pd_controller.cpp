@@ -4,6 +4,7 @@
 #include "status_light.h"
 #include "output_en.h"
 #include "rtt.h"
+#include "sink_capabilities.h"
 #include "time.h"
 #include "tcpc.h"
 #include "utils.h"
@@ -57,7 +58,15 @@ void USBPDController::handle_alert() {
       rtt_printf("Hard reset");
       _phy.set_register(PHY_REG_ALERT, BIT_3);
       _msg_id_counter = 0;
-      _delegate.controller_disconnected(*this);
+      _pps_request = 0;
+      _keep_alive_inflight = false;
+      set_spec_rev(SpecificationRev::two_v_zero);
+      _source_info_requested = false;
+      _source_status = SourceStatus();
+      _extended_rx.release();
+      if(_delegate) {
+        _delegate->controller_disconnected(*this);
+      }
     }
 
     if(alert_status & BIT_4) {
@@ -145,16 +154,20 @@ void USBPDController::handle_alert() {
 }
 
 void USBPDController::send_control_msg(ControlMessageType message_type) {
-  MessageHeader message;
-  setmem(&message, 0, sizeof(MessageHeader));
+  uint8_t buffer[PD_HEADER_SIZE] = {0};
+  store_le16(buffer, header::encode((uint8_t)message_type, _spec_rev, _msg_id_counter & 0x07, 0));
+  _msg_id_counter++;
+
+  _phy.tx_usb_pd_msg(sizeof(buffer), buffer);
+}
 
-  message.message_type = (uint8_t)message_type;
-  message.num_data_obj = 0;
-  message.spec_rev = 1;
-  message.message_id = _msg_id_counter;
+void USBPDController::send_sink_caps() {
+  uint8_t buffer[PD_HEADER_SIZE + SINK_CAPABILITIES_SIZE] = {0};
+  store_le16(buffer, header::encode((uint8_t)DataMessageType::sink_capabilities, _spec_rev, _msg_id_counter & 0x07, SINK_CAPABILITY_COUNT));
+  cpymem(buffer + PD_HEADER_SIZE, sink_capability_objects, SINK_CAPABILITIES_SIZE);
   _msg_id_counter++;
 
-  _phy.tx_usb_pd_msg(sizeof(MessageHeader), (uint8_t*)&message);
+  _phy.tx_usb_pd_msg(sizeof(buffer), buffer);
 }
 
 void USBPDController::send_hard_reset() {
@@ -175,7 +188,14 @@ void USBPDController::request_capability(const SourceCapability& capability) {
 
 void USBPDController::request_capability(const SourceCapability& capability, uint32_t power) {
   Request request(capability, power);
-  send_request(request.generate_pdo());
+  uint32_t pdo = request.generate_pdo();
+
+  // PPS contracts have to be refreshed so tick sends the same request again
+  _pps_request = request.needs_keep_alive() ? pdo : 0;
+  _pps_request_time = system_time();
+  _keep_alive_inflight = false;
+
+  send_request(pdo);
 }
 
 void USBPDController::tick() {
@@ -194,6 +214,15 @@ void USBPDController::tick() {
     _state = PDState::unknown;
     _caps_timer = system_time();
   }
+
+  if(_pps_request != 0 && (system_time() - _pps_request_time) > PPS_KEEP_ALIVE_MS) {
+    // The source answers with accept and PS_RDY which are kept from the delegate
+    _keep_alive_inflight = true;
+    _pps_request_time = system_time();
+    send_request(_pps_request);
+  }
+
+  _extended_rx.check_timeout();
 }
 
 void USBPDController::handle_msg_rx() {
@@ -202,9 +231,16 @@ void USBPDController::handle_msg_rx() {
   _phy.rx_usb_pd_msg(msg_length, (uint8_t*)msg_buffer);
   _phy.set_register(PHY_REG_ALERT, BIT_2);
 
-  MessageHeader* msg_header = (MessageHeader*)(msg_buffer);
-  if(msg_header->num_data_obj == 0) {
-    ControlMessageType message_type  = (ControlMessageType)(msg_header->message_type);
+  uint16_t msg_header = load_le16(msg_buffer);
+
+  // Extended message types overlap the data message types so they're split off first
+  if(header::Extended::get(msg_header)) {
+    handle_extended_msg(msg_buffer, msg_length);
+    return;
+  }
+
+  if(header::NumDataObjects::get(msg_header) == 0) {
+    ControlMessageType message_type  = (ControlMessageType)(header::MessageType::get(msg_header));
     switch(message_type) {
       case ControlMessageType::good_crc:
         // Good CRC, handled by TCPC
@@ -212,33 +248,57 @@ void USBPDController::handle_msg_rx() {
         break;
       case ControlMessageType::goto_min:
         rtt_printf("Goto min");
-        _delegate.go_to_min_received(*this);
+        if(_delegate) {
+          _delegate->go_to_min_received(*this);
+        }
         break;
       case ControlMessageType::accept:
         rtt_printf("Accept");
-        _delegate.accept_received(*this);
+        if(_delegate && !_keep_alive_inflight) {
+          _delegate->accept_received(*this);
+        }
         break;
       case ControlMessageType::reject:
         rtt_printf("Reject");
-        _delegate.reject_received(*this);
+        _pps_request = 0;
+        _keep_alive_inflight = false;
+        if(_delegate) {
+          _delegate->reject_received(*this);
+        }
         break;
       case ControlMessageType::ping:
         rtt_printf("Ping");
         break;
       case ControlMessageType::ps_rdy:
         rtt_printf("Ps rdy");
-        _delegate.ps_ready_received(*this);
+        if(_keep_alive_inflight) {
+          _keep_alive_inflight = false;
+        } else if(_delegate) {
+          _delegate->ps_ready_received(*this);
+        }
+        if(!_source_info_requested && _spec_rev >= SpecificationRev::three_v_zero) {
+          _source_info_requested = true;
+          send_control_msg(ControlMessageType::get_source_cap_extended);
+        }
+        break;
+      case ControlMessageType::get_sink_cap:
+        rtt_printf("Get sink cap");
+        send_sink_caps();
         break;
       case ControlMessageType::soft_reset:
         rtt_printf("Soft reset");
         _msg_id_counter = 0;
+        _pps_request = 0;
+        _keep_alive_inflight = false;
         send_control_msg(ControlMessageType::accept);
-        _delegate.reset_received(*this);
+        if(_delegate) {
+          _delegate->reset_received(*this);
+        }
       default:
         break;
     }
   } else {
-    DataMessageType message_type = (DataMessageType)(msg_header->message_type);
+    DataMessageType message_type = (DataMessageType)(header::MessageType::get(msg_header));
     switch(message_type) {
       case DataMessageType::source_capabilities:
         rtt_printf("Caps RX");
@@ -249,6 +309,10 @@ void USBPDController::handle_msg_rx() {
         break;
       case DataMessageType::sink_capabilities:
         break;
+      case DataMessageType::alert:
+        rtt_printf("Alert");
+        handle_alert_msg(msg_buffer, msg_length);
+        break;
       case DataMessageType::vendor_defined:
         send_control_msg(ControlMessageType::reject);
         break;
@@ -259,12 +323,76 @@ void USBPDController::handle_msg_rx() {
 }
 
 void USBPDController::handle_src_caps_msg(const uint8_t* message, uint32_t len) {
-  MessageHeader* msg_hdr = (MessageHeader*)message;
-  PowerDataObject* pdos = (PowerDataObject*)(message + 2);
+  uint16_t msg_hdr = load_le16(message);
+  _source_caps = SourceCapabilities(message + PD_HEADER_SIZE, header::NumDataObjects::get(msg_hdr));
 
-  _source_caps = SourceCapabilities(pdos, msg_hdr->num_data_obj);
+  // Talk to the source at the lower of both revisions from here on
+  if(header::negotiate_spec_rev(msg_hdr) != _spec_rev) {
+    set_spec_rev(header::negotiate_spec_rev(msg_hdr));
+  }
+  _keep_alive_inflight = false;
 
-  _delegate.capabilities_received(*this, _source_caps);
+  if(_delegate) {
+    _delegate->capabilities_received(*this, _source_caps);
+  }
+}
+
+void USBPDController::handle_extended_msg(const uint8_t* message, uint32_t len) {
+  switch(_extended_rx.receive(message, len)) {
+    case ChunkStatus::need_chunk: {
+      uint8_t buffer[PD_CHUNK_REQUEST_SIZE] = {0};
+      encode_chunk_request(buffer, _extended_rx.type(), _spec_rev, _msg_id_counter, _extended_rx.next_chunk());
+      _msg_id_counter++;
+      _phy.tx_usb_pd_msg(sizeof(buffer), buffer);
+      break;
+    }
+    case ChunkStatus::complete:
+      switch(_extended_rx.type()) {
+        case ExtendedMessageType::source_capabilities_extended:
+          _source_status.update_extended_caps(_extended_rx.message()->data, _extended_rx.message()->size);
+          rtt_printf("Src PDP %dW", _source_status.pdp);
+          handle_status_update();
+          break;
+        case ExtendedMessageType::status:
+          _source_status.update_status(_extended_rx.message()->data, _extended_rx.message()->size);
+          rtt_printf("Src status - %dC", _source_status.temperature);
+          handle_status_update();
+          break;
+        default:
+          rtt_printf("Ext msg %d RX, %d bytes", (uint8_t)_extended_rx.type(), _extended_rx.message()->size);
+          send_control_msg(ControlMessageType::not_supported);
+          break;
+      }
+      _extended_rx.release();
+      break;
+    default:
+      rtt_printf("Ext msg dropped");
+      break;
+  }
+}
+
+void USBPDController::handle_alert_msg(const uint8_t* message, uint32_t len) {
+  if(len < PD_HEADER_SIZE + PD_DATA_OBJECT_SIZE) {
+    return;
+  }
+
+  // Pass on what the alert flags straight away and ask for the full status behind it
+  _source_status.update_alert(load_le32(message + PD_HEADER_SIZE));
+  handle_status_update();
+  send_control_msg(ControlMessageType::get_status);
+}
+
+void USBPDController::handle_status_update() {
+  if(_delegate) {
+    _delegate->status_received(*this, _source_status);
+  }
+}
+
+void USBPDController::set_spec_rev(SpecificationRev spec_rev) {
+  // The TCPC builds the GoodCRC replies so it has to know the revision too
+  _spec_rev = spec_rev;
+  _phy.set_register(PHY_REG_MSG_HDR_INFO, (uint8_t)spec_rev << 1);
+  rtt_printf("PD rev %d", (uint8_t)spec_rev + 1);
 }
 
 void USBPDController::handle_cc_status() {
@@ -280,24 +408,24 @@ void USBPDController::handle_cc_status() {
   }
 
   if(_cc_partner && (cc1_status | cc2_status) == 0) {
-    _delegate.controller_disconnected(*this);
+    set_spec_rev(SpecificationRev::two_v_zero);
+    _source_info_requested = false;
+    _source_status = SourceStatus();
+    _extended_rx.release();
+    _pps_request = 0;
+    _keep_alive_inflight = false;
+    if(_delegate) {
+      _delegate->controller_disconnected(*this);
+    }
   }
   _cc_partner = cc1_status || cc2_status;
 }
 
 void USBPDController::send_request(const uint32_t& request_data) {
-  MessageHeader req_hdr;
-  setmem(&req_hdr, 0, sizeof(req_hdr));
-
-  req_hdr.num_data_obj = 1;
-  req_hdr.message_type = (uint8_t)DataMessageType::request;
-  req_hdr.spec_rev = (uint8_t)SpecificationRev::two_v_zero;
-  req_hdr.message_id = _msg_id_counter;
+  uint8_t buffer[PD_HEADER_SIZE + PD_DATA_OBJECT_SIZE] = {0};
+  store_le16(buffer, header::encode((uint8_t)DataMessageType::request, _spec_rev, _msg_id_counter & 0x07, 1));
+  store_le32(buffer + PD_HEADER_SIZE, request_data);
   _msg_id_counter++;
 
-  uint8_t buffer[6] = {0};
-  cpymem(buffer, &req_hdr, sizeof(req_hdr));
-  cpymem(buffer + 2, &request_data, sizeof(request_data));
-
   _phy.tx_usb_pd_msg(sizeof(buffer), buffer);
 }
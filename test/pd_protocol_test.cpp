@@ -0,0 +1,355 @@
+/**
+ * @brief Host round trip test of the PD header, PDO and RDO codec
+ * @note Runs on the build machine, the Bazel build is target only:
+ *   g++ -std=c++11 -Wall -Iinclude -o /tmp/pd_protocol_test test/pd_protocol_test.cpp src/pd_protocol.cpp src/units.cpp
+ *   /tmp/pd_protocol_test
+ */
+
+#include <stdio.h>
+
+#include "pd_protocol.h"
+
+
+namespace {
+
+
+uint32_t failures = 0;
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+void check(bool passed, const char* condition, int line) {
+  if(!passed) {
+    printf("line %d: %s\n", line, condition);
+    failures++;
+  }
+}
+
+// Setting a field reads back what was set and leaves the rest of the word alone
+template <typename Field>
+void check_field(uint32_t background) {
+  uint32_t others = ~Field::set(Field::mask());
+  for(uint32_t value = 0; value <= Field::mask(); value++) {
+    uint32_t word = Field::replace(background, value);
+    CHECK(Field::get(word) == value);
+    CHECK((word & others) == (background & others));
+  }
+}
+
+// Every value a field can hold with the other fields at all zeros and all ones
+template <typename Field>
+void check_field() {
+  check_field<Field>(0);
+  check_field<Field>(0xFFFFFFFF);
+}
+
+
+void test_header() {
+  check_field<header::MessageType>();
+  check_field<header::PortDataRole>();
+  check_field<header::SpecRev>();
+  check_field<header::PortPowerRole>();
+  check_field<header::MessageID>();
+  check_field<header::NumDataObjects>();
+  check_field<header::Extended>();
+
+  for(uint32_t message_type = 0; message_type < 32; message_type++) {
+    for(uint32_t spec_rev = 0; spec_rev < 4; spec_rev++) {
+      for(uint32_t message_id = 0; message_id < 8; message_id++) {
+        for(uint32_t count = 0; count < 8; count++) {
+          uint16_t word = header::encode(message_type, (SpecificationRev)spec_rev, message_id, count);
+          CHECK(header::MessageType::get(word) == message_type);
+          CHECK(header::SpecRev::get(word) == spec_rev);
+          CHECK(header::MessageID::get(word) == message_id);
+          CHECK(header::NumDataObjects::get(word) == count);
+          CHECK(header::Extended::get(word) == 0);
+          CHECK(header::PortDataRole::get(word) == 0);
+          CHECK(header::PortPowerRole::get(word) == 0);
+
+          uint16_t extended = header::encode_extended(message_type, (SpecificationRev)spec_rev, message_id, count);
+          CHECK(extended == (word | 0x8000));
+        }
+      }
+    }
+  }
+
+  CHECK(header::negotiate_spec_rev(header::encode(0, SpecificationRev::one_v_zero, 0, 0)) == SpecificationRev::one_v_zero);
+  CHECK(header::negotiate_spec_rev(header::encode(0, SpecificationRev::two_v_zero, 0, 0)) == SpecificationRev::two_v_zero);
+  CHECK(header::negotiate_spec_rev(header::encode(0, SpecificationRev::three_v_zero, 0, 0)) == SpecificationRev::three_v_zero);
+  CHECK(header::negotiate_spec_rev(header::encode(0, SpecificationRev::reserved, 0, 0)) == PD_SPEC_REV);
+}
+
+void test_extended_header() {
+  check_field<extended_header::DataSize>();
+  check_field<extended_header::RequestChunk>();
+  check_field<extended_header::ChunkNumber>();
+  check_field<extended_header::Chunked>();
+
+  for(uint32_t data_size = 0; data_size < 512; data_size++) {
+    for(uint32_t chunk = 0; chunk < 16; chunk++) {
+      for(uint32_t request = 0; request < 2; request++) {
+        uint16_t word = extended_header::encode(data_size, chunk, request);
+        CHECK(extended_header::DataSize::get(word) == data_size);
+        CHECK(extended_header::ChunkNumber::get(word) == chunk);
+        CHECK(extended_header::RequestChunk::get(word) == request);
+        CHECK(extended_header::Chunked::get(word) == 1);
+        CHECK((word & 0x0200) == 0);
+      }
+    }
+  }
+}
+
+void test_fixed_pdo() {
+  check_field<fixed_pdo::MaxCurrent10mA>();
+  check_field<fixed_pdo::Voltage50mV>();
+  check_field<fixed_pdo::PeakCurrent>();
+  check_field<fixed_pdo::EPRModeCapable>();
+  check_field<fixed_pdo::DualRoleData>();
+  check_field<fixed_pdo::USBCommCapable>();
+  check_field<fixed_pdo::UnconstrainedPower>();
+  check_field<fixed_pdo::SuspendSupported>();
+  check_field<fixed_pdo::DualRolePower>();
+  check_field<SupplyType>();
+
+  for(uint32_t voltage = 0; voltage < 1024; voltage++) {
+    for(uint32_t current = 0; current < 1024; current += 31) {
+      uint32_t pdo = fixed_pdo::encode(voltage, current);
+      CHECK(SupplyType::get(pdo) == (uint8_t)PowerDataObjectType::fixed);
+      CHECK(fixed_pdo::Voltage50mV::get(pdo) == voltage);
+      CHECK(fixed_pdo::MaxCurrent10mA::get(pdo) == current);
+
+      SourceCapability capability(pdo, 0);
+      CHECK(capability.type() == PowerDataObjectType::fixed);
+      CHECK(capability.voltage() == voltage * 50);
+      CHECK(capability.current() == current * 10);
+      CHECK(capability.min_voltage() == capability.voltage());
+      CHECK(capability.max_voltage() == capability.voltage());
+    }
+  }
+}
+
+void test_battery_pdo() {
+  check_field<battery_pdo::MaxPower250mW>();
+  check_field<battery_pdo::MinVoltage50mV>();
+  check_field<battery_pdo::MaxVoltage50mV>();
+
+  for(uint32_t min_voltage = 0; min_voltage < 1024; min_voltage += 7) {
+    for(uint32_t max_voltage = min_voltage; max_voltage < 1024; max_voltage += 13) {
+      uint32_t pdo = battery_pdo::encode(min_voltage, max_voltage, 1023);
+      CHECK(SupplyType::get(pdo) == (uint8_t)PowerDataObjectType::battery);
+      CHECK(battery_pdo::MinVoltage50mV::get(pdo) == min_voltage);
+      CHECK(battery_pdo::MaxVoltage50mV::get(pdo) == max_voltage);
+      CHECK(battery_pdo::MaxPower250mW::get(pdo) == 1023);
+
+      SourceCapability capability(pdo, 0);
+      CHECK(capability.is_battery());
+      CHECK(capability.min_voltage() == min_voltage * 50);
+      CHECK(capability.max_voltage() == max_voltage * 50);
+      CHECK(capability.max_power() == 1023 * 250);
+    }
+  }
+}
+
+void test_variable_pdo() {
+  check_field<variable_pdo::MaxCurrent10mA>();
+  check_field<variable_pdo::MinVoltage50mV>();
+  check_field<variable_pdo::MaxVoltage50mV>();
+
+  for(uint32_t min_voltage = 0; min_voltage < 1024; min_voltage += 7) {
+    for(uint32_t max_voltage = min_voltage; max_voltage < 1024; max_voltage += 13) {
+      uint32_t pdo = variable_pdo::encode(min_voltage, max_voltage, 500);
+      CHECK(SupplyType::get(pdo) == (uint8_t)PowerDataObjectType::variable);
+      CHECK(variable_pdo::MinVoltage50mV::get(pdo) == min_voltage);
+      CHECK(variable_pdo::MaxVoltage50mV::get(pdo) == max_voltage);
+      CHECK(variable_pdo::MaxCurrent10mA::get(pdo) == 500);
+
+      SourceCapability capability(pdo, 0);
+      CHECK(capability.type() == PowerDataObjectType::variable);
+      CHECK(capability.current() == 5000);
+      CHECK(capability.voltage() == (((max_voltage - min_voltage) >> 1) + min_voltage) * 50);
+    }
+  }
+}
+
+void test_pps_apdo() {
+  check_field<pps_apdo::AugmentedType>();
+  check_field<pps_apdo::MaxCurrent50mA>();
+  check_field<pps_apdo::MinVoltage100mV>();
+  check_field<pps_apdo::MaxVoltage100mV>();
+  check_field<pps_apdo::PowerLimited>();
+
+  for(uint32_t min_voltage = 0; min_voltage < 256; min_voltage++) {
+    for(uint32_t max_voltage = min_voltage; max_voltage < 256; max_voltage += 5) {
+      for(uint32_t current = 0; current < 128; current += 9) {
+        uint32_t pdo = pps_apdo::encode(min_voltage, max_voltage, current);
+        CHECK(SupplyType::get(pdo) == (uint8_t)PowerDataObjectType::augmented);
+        CHECK(pps_apdo::AugmentedType::get(pdo) == (uint8_t)AugmentedPowerDataObjectType::pps);
+        CHECK(pps_apdo::MinVoltage100mV::get(pdo) == min_voltage);
+        CHECK(pps_apdo::MaxVoltage100mV::get(pdo) == max_voltage);
+        CHECK(pps_apdo::MaxCurrent50mA::get(pdo) == current);
+        CHECK(pps_apdo::PowerLimited::get(pdo) == 0);
+
+        SourceCapability capability(pdo, 0);
+        CHECK(capability.is_pps());
+        CHECK(capability.min_voltage() == min_voltage * 100);
+        CHECK(capability.max_voltage() == max_voltage * 100);
+        CHECK(capability.current() == current * 50);
+      }
+    }
+  }
+
+  // Programming snaps to the 20mV grid and stays inside the range
+  SourceCapability capability(pps_apdo::encode(33, 210, 60), 0);
+  CHECK(capability.voltage() == 21000);
+  CHECK(capability.programmed(9010).voltage() == 9000);
+  CHECK(capability.programmed(1000).voltage() == 3300);
+  CHECK(capability.programmed(30000).voltage() == 21000);
+
+  // Other APDOs aren't PPS
+  uint32_t avs = pps_apdo::AugmentedType::replace(pps_apdo::encode(33, 210, 60), (uint8_t)AugmentedPowerDataObjectType::epr_avs);
+  CHECK(!SourceCapability(avs, 0).is_pps());
+  CHECK(SourceCapability(avs, 0).voltage() == 0);
+}
+
+void test_request_do() {
+  check_field<request_do::EPRModeCapable>();
+  check_field<request_do::NoUSBSuspend>();
+  check_field<request_do::USBCommCapable>();
+  check_field<request_do::CapabilityMismatch>();
+  check_field<request_do::GiveBack>();
+  check_field<request_do::ObjectPosition>();
+  check_field<request_do::MaxCurrent10mA>();
+  check_field<request_do::OpCurrent10mA>();
+  check_field<request_do::MaxPower250mW>();
+  check_field<request_do::OpPower250mW>();
+  check_field<request_do::OpCurrent50mA>();
+  check_field<request_do::OutputVoltage20mV>();
+
+  for(uint32_t position = 1; position < 16; position++) {
+    for(uint32_t op = 0; op < 1024; op += 3) {
+      uint32_t rdo = request_do::encode_fixed(position, op, 1023 - op);
+      CHECK(request_do::ObjectPosition::get(rdo) == position);
+      CHECK(request_do::OpCurrent10mA::get(rdo) == op);
+      CHECK(request_do::MaxCurrent10mA::get(rdo) == 1023 - op);
+      CHECK(request_do::GiveBack::get(rdo) == 0);
+
+      rdo = request_do::encode_battery(position, op, 1023 - op);
+      CHECK(request_do::ObjectPosition::get(rdo) == position);
+      CHECK(request_do::OpPower250mW::get(rdo) == op);
+      CHECK(request_do::MaxPower250mW::get(rdo) == 1023 - op);
+    }
+
+    for(uint32_t voltage = 0; voltage < 4096; voltage += 5) {
+      uint32_t rdo = request_do::encode_pps(position, voltage, voltage & 0x7F);
+      CHECK(request_do::ObjectPosition::get(rdo) == position);
+      CHECK(request_do::OutputVoltage20mV::get(rdo) == voltage);
+      CHECK(request_do::OpCurrent50mA::get(rdo) == (voltage & 0x7F));
+      CHECK(request_do::CapabilityMismatch::get(rdo) == 0);
+    }
+  }
+}
+
+void test_epr_mode_do() {
+  check_field<epr_mode_do::Data>();
+  check_field<epr_mode_do::Action>();
+
+  for(uint32_t action = 0; action <= (uint8_t)EPRModeAction::exit; action++) {
+    for(uint32_t data = 0; data < 256; data++) {
+      uint32_t word = epr_mode_do::encode((EPRModeAction)action, data);
+      CHECK(epr_mode_do::Action::get(word) == action);
+      CHECK(epr_mode_do::Data::get(word) == data);
+      CHECK((word & 0xFFFF) == 0);
+    }
+  }
+}
+
+void test_little_endian() {
+  uint8_t buffer[6] = {};
+
+  for(uint32_t value = 0; value < 0x10000; value += 0x101) {
+    store_le16(buffer + 1, value);
+    CHECK(buffer[1] == (value & 0xFF));
+    CHECK(buffer[2] == (value >> 8));
+    CHECK(load_le16(buffer + 1) == value);
+  }
+
+  const uint32_t words[] = {0, 1, 0x80, 0x8000, 0x800000, 0x80000000, 0x12345678, 0xFFFFFFFF};
+  for(uint32_t index = 0; index < sizeof(words) / sizeof(words[0]); index++) {
+    // Odd offset to catch anything that assumes alignment
+    store_le32(buffer + 1, words[index]);
+    CHECK(buffer[1] == (words[index] & 0xFF));
+    CHECK(buffer[4] == (words[index] >> 24));
+    CHECK(load_le32(buffer + 1) == words[index]);
+  }
+}
+
+void test_source_capabilities() {
+  const uint32_t pdos[] = {
+    fixed_pdo::encode(100, 300) | fixed_pdo::EPRModeCapable::set(1),
+    fixed_pdo::encode(180, 300),
+    fixed_pdo::encode(400, 500),
+    battery_pdo::encode(100, 400, 240),
+    variable_pdo::encode(100, 400, 300),
+    pps_apdo::encode(33, 210, 60),
+    pps_apdo::encode(33, 110, 100),
+    fixed_pdo::encode(560, 500),
+    fixed_pdo::encode(720, 500),
+    pps_apdo::AugmentedType::replace(pps_apdo::encode(150, 280, 100), (uint8_t)AugmentedPowerDataObjectType::epr_avs),
+    fixed_pdo::encode(960, 500),
+    fixed_pdo::encode(20, 10),
+  };
+  const uint8_t pdo_count = sizeof(pdos) / sizeof(pdos[0]);
+
+  // Offset by the message header like a received message
+  uint8_t message[PD_HEADER_SIZE + pdo_count * PD_DATA_OBJECT_SIZE] = {};
+  for(uint8_t index = 0; index < pdo_count; index++) {
+    store_le32(message + PD_HEADER_SIZE + index * PD_DATA_OBJECT_SIZE, pdos[index]);
+  }
+
+  SourceCapabilities caps(message + PD_HEADER_SIZE, 5);
+  CHECK(caps.count() == 5);
+  for(uint8_t index = 0; index < 5; index++) {
+    CHECK(caps.pdo(index) == pdos[index]);
+    CHECK(caps.cap(index).pdo() == pdos[index]);
+    CHECK(caps.cap(index).index() == index);
+  }
+  CHECK(caps.cap(5).pdo() == 0);
+  CHECK(caps.cap(0).voltage() == 5000);
+  CHECK(caps.cap(2).max_power() == 100000);
+
+  // EPR caps stop at MAX_EPR_CAPABILITIES
+  SourceCapabilities epr_caps(message + PD_HEADER_SIZE, pdo_count);
+  CHECK(epr_caps.count() == MAX_EPR_CAPABILITIES);
+  for(uint8_t index = 0; index < MAX_EPR_CAPABILITIES; index++) {
+    CHECK(epr_caps.pdo(index) == pdos[index]);
+  }
+  CHECK(epr_caps.cap(MAX_EPR_CAPABILITIES).pdo() == 0);
+  CHECK(epr_caps.cap(EPR_FIRST_CAPABILITY).voltage() == 28000);
+
+  SourceCapabilities empty;
+  CHECK(empty.count() == 0);
+  CHECK(empty.cap(0).pdo() == 0);
+}
+
+
+} // namespace
+
+
+int main() {
+  test_header();
+  test_extended_header();
+  test_fixed_pdo();
+  test_battery_pdo();
+  test_variable_pdo();
+  test_pps_apdo();
+  test_request_do();
+  test_epr_mode_do();
+  test_little_endian();
+  test_source_capabilities();
+
+  if(failures > 0) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,263 @@
+#!/usr/bin/env python3
+"""
+Static stack budget from the GCC call graph
+
+Build with the call graph dumped next to each object, the sandbox has to be off so the .ci files are kept:
+  bazel build --copt=-fcallgraph-info=su --spawn_strategy=standalone :starlink-pd-supply
+  python3 tools/stack_report.py --map /tmp/starlink-pd.map bazel-out/
+
+Sums the deepest call path from Reset_Handler and from every handler in the vector table. Interrupts all
+run at the same priority so the worst case is the main loop, one interrupt and a fault on top of that.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+
+# Registers the core stacks on exception entry, r0-r3, r12, lr, pc, xpsr
+EXCEPTION_FRAME_BYTES = 32
+
+# Entry points that aren't reached through a call
+MAIN_ROOT = "Reset_Handler"
+FAULT_ROOTS = ("HardFault_Handler", "Default_Handler")
+HANDLER_PATTERN = re.compile(r"_(ISR|Handler)$")
+
+# Naked handlers branch to these in asm so the call graph doesn't see it
+NAKED_TARGETS = {
+  "HardFault_Handler": "hard_fault",
+  "Default_Handler": "default_fault",
+}
+
+# Indirect calls can't be followed in the call graph, these are the virtual interfaces behind them
+# Each caller pattern maps to the functions it can reach through a pointer
+INDIRECT_TARGETS = (
+  # ControllerDelegate
+  (re.compile(r"^(STMPD|USBPDController)::"),
+   re.compile(r"^PowerMux::(\w+_received|controller_disconnected)$")),
+  # IController
+  (re.compile(r"^PowerMux::"),
+   re.compile(r"^(STMPD|USBPDController)::(caps|send_control_msg|send_hard_reset|request_capability|set_delegate)$")),
+  # AlertDelegate
+  (re.compile(r"^PTN5110::"), re.compile(r"^USBPDController::handle_alert$")),
+)
+
+NODE_PATTERN = re.compile(r'node: \{ title: "([^"]+)" label: "([^"]*)"')
+EDGE_PATTERN = re.compile(r'edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"')
+STACK_PATTERN = re.compile(r"(\d+) bytes \(([a-z,]+)\)")
+MAP_SYMBOL_PATTERN = r"^\s*0x([0-9a-f]+)\s+(?:PROVIDE \(\s*)?{}\s*="
+
+
+class Function:
+  def __init__(self, symbol):
+    self.symbol = symbol
+    self.name = symbol
+    self.location = ""
+    self.stack = None
+    self.dynamic = False
+    self.calls = set()
+
+  def short_name(self):
+    # Drop the return type and arguments, "void PowerMux::tick()" -> "PowerMux::tick"
+    name = self.name.split("(")[0]
+    return name.split(" ")[-1]
+
+
+def load_call_graph(paths):
+  functions = {}
+
+  def function(symbol):
+    if symbol not in functions:
+      functions[symbol] = Function(symbol)
+    return functions[symbol]
+
+  for path in paths:
+    with open(path) as ci_file:
+      for line in ci_file:
+        node = NODE_PATTERN.search(line)
+        if node:
+          entry = function(node.group(1))
+          lines = node.group(2).split("\\n")
+          stack = STACK_PATTERN.search(node.group(2))
+
+          # Calls to other files only have the declaration, the definition's label wins
+          if stack or not entry.location:
+            # Variadic functions lose their name in the label
+            if "(" in lines[0]:
+              entry.name = lines[0]
+            if len(lines) > 1:
+              entry.location = lines[1]
+
+          if stack:
+            # Inline functions show up in every file that uses them, keep the biggest
+            entry.stack = max(entry.stack or 0, int(stack.group(1)))
+            entry.dynamic |= "dynamic" in stack.group(2)
+          continue
+
+        edge = EDGE_PATTERN.search(line)
+        if edge:
+          function(edge.group(1)).calls.add(edge.group(2))
+          function(edge.group(2))
+
+  # Complete constructors and destructors are aliases of the base object versions GCC actually emits
+  for symbol, entry in functions.items():
+    alias = re.sub(r"([CD])1(E)", r"\g<1>2\g<2>", symbol, count=1)
+    if entry.stack is None and alias != symbol and alias in functions:
+      entry.calls.add(alias)
+      entry.stack = 0
+
+  return functions
+
+
+def find_ci_files(paths):
+  for path in paths:
+    if os.path.isfile(path):
+      yield path
+      continue
+    for directory, _, files in os.walk(path):
+      for name in files:
+        if name.endswith(".ci"):
+          yield os.path.join(directory, name)
+
+
+class StackBudget:
+  def __init__(self, functions):
+    self.functions = functions
+    self.by_name = {}
+    for function in functions.values():
+      if function.stack is not None or function.short_name() not in self.by_name:
+        self.by_name[function.short_name()] = function
+
+    for handler, target in NAKED_TARGETS.items():
+      if handler in self.by_name and target in self.by_name:
+        self.by_name[handler].calls.add(self.by_name[target].symbol)
+    self.depths = {}
+    self.unknown = set()
+    self.recursive = set()
+    self.dynamic = set()
+    self.indirect = set()
+    self.in_progress = set()
+
+  def indirect_targets(self, caller):
+    for caller_pattern, target_pattern in INDIRECT_TARGETS:
+      if caller_pattern.search(caller.short_name()):
+        return [function for function in self.functions.values()
+                if function.stack is not None and target_pattern.search(function.short_name())]
+    self.indirect.add(caller.short_name())
+    return []
+
+  def depth(self, function):
+    """Deepest stack use from function down and the call path that gets there"""
+    if function.symbol in self.depths:
+      return self.depths[function.symbol]
+
+    if function.stack is None:
+      if function.symbol != "__indirect_call":
+        self.unknown.add(function.short_name())
+      return 0, [function]
+    if function.dynamic:
+      self.dynamic.add(function.short_name())
+
+    callees = []
+    for symbol in sorted(function.calls):
+      if symbol == "__indirect_call":
+        callees.extend(self.indirect_targets(function))
+      else:
+        callees.append(self.functions[symbol])
+
+    # Calls back into a function still being walked are recursion, the loop is only counted once
+    self.in_progress.add(function.symbol)
+    deepest, deepest_path = 0, []
+    for callee in callees:
+      if callee.symbol in self.in_progress:
+        self.recursive.add(callee.short_name())
+        continue
+      callee_depth, callee_path = self.depth(callee)
+      if callee_depth > deepest:
+        deepest, deepest_path = callee_depth, callee_path
+    self.in_progress.discard(function.symbol)
+
+    self.depths[function.symbol] = (function.stack + deepest, [function] + deepest_path)
+    return self.depths[function.symbol]
+
+  def root(self, name):
+    return self.by_name.get(name)
+
+
+def map_symbol(map_text, name):
+  match = re.search(MAP_SYMBOL_PATTERN.format(re.escape(name)), map_text, re.MULTILINE)
+  return int(match.group(1), 16) if match else None
+
+
+def print_path(title, depth, path):
+  print("{}: {} bytes".format(title, depth))
+  for function in path:
+    stack = "?" if function.stack is None else function.stack
+    print("  {:>5}  {}  {}".format(stack, function.short_name(), function.location))
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__.strip().split("\n")[0])
+  parser.add_argument("paths", nargs="+", help=".ci files or directories to search for them")
+  parser.add_argument("--map", help="linker map, adds the RAM left between static data and the worst case")
+  parser.add_argument("--verbose", action="store_true", help="print the deepest path for every handler")
+  args = parser.parse_args()
+
+  ci_files = sorted(set(find_ci_files(args.paths)))
+  if not ci_files:
+    sys.exit("No .ci files found, build with --copt=-fcallgraph-info=su")
+
+  budget = StackBudget(load_call_graph(ci_files))
+
+  main_root = budget.root(MAIN_ROOT)
+  if main_root is None:
+    sys.exit("No {} in the call graph".format(MAIN_ROOT))
+  main_depth, main_path = budget.depth(main_root)
+  print_path("Main loop", main_depth, main_path)
+
+  # Deepest interrupt and fault handler, each one stacks an exception frame on top of what it was running over
+  worst = {}
+  for name, function in sorted(budget.by_name.items()):
+    if name == MAIN_ROOT or not HANDLER_PATTERN.search(name) or function.stack is None:
+      continue
+    kind = "fault" if name in FAULT_ROOTS else "interrupt"
+    depth, path = budget.depth(function)
+    depth += EXCEPTION_FRAME_BYTES
+    if args.verbose:
+      print_path(name, depth, path)
+    if depth > worst.get(kind, (0, None, None))[0]:
+      worst[kind] = (depth, name, path)
+
+  total = main_depth
+  for kind in ("interrupt", "fault"):
+    if kind in worst:
+      depth, name, path = worst[kind]
+      if not args.verbose:
+        print_path("Worst {} ({})".format(kind, name), depth, path)
+      total += depth
+
+  print()
+  print("Worst case stack: {} bytes".format(total))
+
+  if args.map:
+    with open(args.map) as map_file:
+      map_text = map_file.read()
+    bottom = map_symbol(map_text, "__stack_bottom__")
+    top = map_symbol(map_text, "_stack_ptr")
+    if bottom is None or top is None:
+      print("Stack bounds not found in {}".format(args.map))
+    else:
+      print("Stack space: {} bytes, headroom {} bytes".format(top - bottom, top - bottom - total))
+
+  # Anything that makes the total a guess
+  for title, names in (("No stack info, counted as 0", budget.unknown),
+                       ("Dynamic stack, only the fixed part counted", budget.dynamic),
+                       ("Recursion, counted once", budget.recursive),
+                       ("Unresolved indirect calls", budget.indirect)):
+    if names:
+      print("{}: {}".format(title, ", ".join(sorted(names))))
+
+
+if __name__ == "__main__":
+  main()